@@ -0,0 +1,120 @@
+// Component lookup tables, foundation::Hash against SparseArray, for the
+// operations a component does per entity: add, lookup in creation and in
+// random order, and the set plus remove of a destroy.
+//
+//   component_lookup_bench [million entities]
+
+#include "entity_manager.h"
+#include "sparse_array.h"
+
+#include <hash.h>
+#include <memory.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+using namespace knight;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct HashTable {
+  explicit HashTable(foundation::Allocator &allocator) : map{allocator} { }
+
+  void set(Entity::ID id, uint32_t value) { foundation::hash::set(map, id, value); }
+  uint32_t get(Entity::ID id) const { return foundation::hash::get(map, id, 0u); }
+  void remove(Entity::ID id) { foundation::hash::remove(map, id); }
+
+  foundation::Hash<uint32_t> map;
+};
+
+struct SparseTable {
+  explicit SparseTable(foundation::Allocator &allocator) : map{allocator} { }
+
+  void set(Entity::ID id, uint32_t value) { map.set(id, value); }
+  uint32_t get(Entity::ID id) const { return map.get(id, 0u); }
+  void remove(Entity::ID id) { map.remove(id); }
+
+  SparseArray<uint32_t> map;
+};
+
+template<typename F>
+double time_ns_per(size_t count, F &&f) {
+  auto start = Clock::now();
+  f();
+  return std::chrono::duration<double, std::nano>(Clock::now() - start).count() / count;
+}
+
+template<typename Table>
+void bench(const char *name, const std::vector<Entity::ID> &ids, const std::vector<Entity::ID> &shuffled) {
+  auto &allocator = foundation::memory_globals::default_allocator();
+  Table table{allocator};
+  uint64_t sum = 0u;
+
+  auto add = time_ns_per(ids.size(), [&] {
+    for (auto i = 0_z; i < ids.size(); ++i) {
+      table.set(ids[i], static_cast<uint32_t>(i));
+    }
+  });
+
+  auto in_order = time_ns_per(ids.size(), [&] {
+    for (auto &&id : ids) {
+      sum += table.get(id);
+    }
+  });
+
+  auto random = time_ns_per(shuffled.size(), [&] {
+    for (auto &&id : shuffled) {
+      sum += table.get(id);
+    }
+  });
+
+  // The first half of the entities is destroyed, each time the component's
+  // last instance moves into the hole the way TransformComponent::destroy
+  // does it
+  auto half = ids.size() / 2u;
+  auto destroy = time_ns_per(half, [&] {
+    for (auto i = 0_z; i < half; ++i) {
+      auto last = ids.size() - 1u - i;
+      table.set(ids[last], static_cast<uint32_t>(i));
+      table.remove(ids[i]);
+    }
+  });
+
+  std::printf("%-12s add %6.1f ns, lookup %6.1f ns in order, %6.1f ns random, destroy %6.1f ns (%llu)\n",
+    name, add, in_order, random, destroy, static_cast<unsigned long long>(sum));
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  auto entity_count = static_cast<size_t>((argc > 1 ? std::atof(argv[1]) : 1.0) * 1e6);
+  entity_count = std::max(entity_count, size_t{2u});
+
+  foundation::memory_globals::init();
+  {
+    auto &allocator = foundation::memory_globals::default_allocator();
+    EntityManager entity_manager{allocator};
+
+    // Churn a little so versions are not all zero
+    std::vector<Entity::ID> ids(entity_count);
+    entity_manager.create(ids);
+    entity_manager.destroy(gsl::as_span(ids.data(), static_cast<std::ptrdiff_t>(entity_count / 4u)));
+    entity_manager.clear_destroyed();
+    entity_manager.create(gsl::as_span(ids.data(), static_cast<std::ptrdiff_t>(entity_count / 4u)));
+
+    auto shuffled = ids;
+    std::shuffle(shuffled.begin(), shuffled.end(), std::mt19937{42u});
+
+    bench<HashTable>("Hash", ids, shuffled);
+    bench<SparseTable>("SparseArray", ids, shuffled);
+  }
+  foundation::memory_globals::shutdown();
+
+  return EXIT_SUCCESS;
+}
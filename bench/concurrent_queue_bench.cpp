@@ -0,0 +1,161 @@
+// Throughput of ConcurrentQueue against BoundedConcurrentQueue, with single
+// and bulk operations, moving small items from producers to consumers.
+//
+//   concurrent_queue_bench [producers] [consumers] [million items]
+
+#include "concurrent_queue.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+using namespace knight;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Tells a consumer to stop, every producer sends one per consumer at the end
+const uint64_t kStop = 0u;
+const uint32_t kBatchSize = 32u;
+
+struct Result {
+  uint64_t items = 0u;
+  uint64_t sum = 0u;
+  char padding[CACHE_LINE_SIZE];
+};
+
+template<typename Produce, typename Consume>
+void run(const char *name, uint32_t producer_count, uint32_t consumer_count, uint64_t item_count,
+         Produce &&produce, Consume &&consume) {
+  auto per_producer = item_count / producer_count;
+  std::vector<Result> results(consumer_count);
+  std::vector<std::thread> threads;
+
+  auto start = Clock::now();
+  for (auto i = 0u; i < consumer_count; ++i) {
+    threads.emplace_back([&consume, &result = results[i], producer_count] {
+      consume(result, producer_count);
+    });
+  }
+  for (auto i = 0u; i < producer_count; ++i) {
+    threads.emplace_back([&produce, i, per_producer, consumer_count] {
+      produce(i * per_producer + 1u, (i + 1u) * per_producer + 1u, consumer_count);
+    });
+  }
+  for (auto &&thread : threads) {
+    thread.join();
+  }
+  auto elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+  uint64_t items = 0u;
+  uint64_t sum = 0u;
+  for (auto &&result : results) {
+    items += result.items;
+    sum += result.sum;
+  }
+
+  auto total = per_producer * producer_count;
+  std::printf("%-28s %u producers, %u consumers, %.2f M items/s\n",
+    name, producer_count, consumer_count, items / elapsed / 1e6);
+
+  if (items != total || sum != total * (total + 1u) / 2u) {
+    std::printf("%s: lost or duplicated items\n", name);
+    std::exit(EXIT_FAILURE);
+  }
+}
+
+template<typename Queue>
+void bench_single(const char *name, Queue &queue, uint32_t producer_count, uint32_t consumer_count, uint64_t item_count) {
+  run(name, producer_count, consumer_count, item_count,
+    [&queue](uint64_t begin, uint64_t end, uint32_t consumers) {
+      for (auto i = begin; i < end; ++i) {
+        queue.push(i);
+      }
+      for (auto i = 0u; i < consumers; ++i) {
+        queue.push(kStop);
+      }
+    },
+    [&queue](Result &result, uint32_t producers) {
+      uint64_t item;
+      while (producers > 0u) {
+        queue.wait_pop(item);
+        if (item == kStop) {
+          --producers;
+          continue;
+        }
+        ++result.items;
+        result.sum += item;
+      }
+    });
+}
+
+void bench_bulk(uint32_t producer_count, uint32_t consumer_count, uint64_t item_count) {
+  BoundedConcurrentQueue<uint64_t> queue{4096};
+
+  run("BoundedConcurrentQueue bulk", producer_count, consumer_count, item_count,
+    [&queue](uint64_t begin, uint64_t end, uint32_t consumers) {
+      uint64_t batch[kBatchSize];
+      auto next = begin;
+      while (next < end) {
+        auto count = 0u;
+        for (; count < kBatchSize && next + count < end; ++count) {
+          batch[count] = next + count;
+        }
+
+        auto pushed = queue.try_push_bulk(batch, count);
+        if (pushed == 0u) {
+          queue.push(next++);
+        }
+        next += pushed;
+      }
+      for (auto i = 0u; i < consumers; ++i) {
+        queue.push(kStop);
+      }
+    },
+    [&queue](Result &result, uint32_t producers) {
+      uint64_t batch[kBatchSize];
+      while (producers > 0u) {
+        auto count = queue.try_pop_bulk(batch, kBatchSize);
+        if (count == 0u) {
+          queue.wait_pop(batch[0]);
+          count = 1u;
+        }
+
+        for (auto i = 0_z; i < count; ++i) {
+          if (batch[i] == kStop) {
+            --producers;
+            continue;
+          }
+          ++result.items;
+          result.sum += batch[i];
+        }
+      }
+    });
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  auto producer_count = argc > 1 ? static_cast<uint32_t>(std::atoi(argv[1])) : 2u;
+  auto consumer_count = argc > 2 ? static_cast<uint32_t>(std::atoi(argv[2])) : 2u;
+  auto item_count = static_cast<uint64_t>((argc > 3 ? std::atof(argv[3]) : 4.0) * 1e6);
+  producer_count = std::max(producer_count, 1u);
+  consumer_count = std::max(consumer_count, 1u);
+
+  {
+    ConcurrentQueue<uint64_t> queue;
+    bench_single("ConcurrentQueue", queue, producer_count, consumer_count, item_count);
+  }
+  {
+    BoundedConcurrentQueue<uint64_t> queue{4096};
+    bench_single("BoundedConcurrentQueue", queue, producer_count, consumer_count, item_count);
+  }
+  bench_bulk(producer_count, consumer_count, item_count);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,89 @@
+// Hand-off latency through SpscChannel and BoundedConcurrentQueue. The
+// producer stamps every item with the time it was pushed, the consumer
+// busy-polls and records how long each one took to arrive.
+//
+//   spsc_channel_bench [items]
+
+#include "concurrent_queue.h"
+#include "spsc_channel.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+using namespace knight;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+uint64_t now() {
+  return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+    Clock::now().time_since_epoch()).count());
+}
+
+template<typename Push, typename Pop>
+void bench(const char *name, uint32_t item_count, Push &&push, Pop &&pop) {
+  // Spacing items out keeps this a latency and not a throughput test
+  const auto kGap = std::chrono::microseconds{2};
+
+  std::vector<uint64_t> latencies;
+  latencies.reserve(item_count);
+
+  std::thread producer([&push, item_count, kGap] {
+    for (auto i = 0u; i < item_count; ++i) {
+      auto next = Clock::now() + kGap;
+      while (!push(now())) {
+        std::this_thread::yield();
+      }
+      while (Clock::now() < next) {
+        cpu_relax();
+      }
+    }
+  });
+
+  uint64_t stamp;
+  while (latencies.size() < item_count) {
+    if (pop(stamp)) {
+      latencies.push_back(now() - stamp);
+    } else {
+      cpu_relax();
+    }
+  }
+  producer.join();
+
+  std::sort(latencies.begin(), latencies.end());
+  auto percentile = [&latencies](double p) {
+    return latencies[std::min(latencies.size() - 1u, static_cast<std::size_t>(p * latencies.size()))];
+  };
+
+  std::printf("%-24s p50 %6llu ns, p99 %8llu ns, max %9llu ns\n", name,
+    static_cast<unsigned long long>(percentile(0.5)),
+    static_cast<unsigned long long>(percentile(0.99)),
+    static_cast<unsigned long long>(latencies.back()));
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  auto item_count = argc > 1 ? static_cast<uint32_t>(std::atoi(argv[1])) : 200000u;
+  item_count = std::max(item_count, 1u);
+
+  {
+    SpscChannel<uint64_t> channel{1024};
+    bench("SpscChannel", item_count,
+      [&channel](uint64_t stamp) { return channel.try_push(stamp); },
+      [&channel](uint64_t &stamp) { return channel.try_pop(stamp); });
+  }
+  {
+    BoundedConcurrentQueue<uint64_t> queue{1024};
+    bench("BoundedConcurrentQueue", item_count,
+      [&queue](uint64_t stamp) { return queue.try_push(stamp); },
+      [&queue](uint64_t &stamp) { return queue.try_pop(stamp); });
+  }
+
+  return EXIT_SUCCESS;
+}
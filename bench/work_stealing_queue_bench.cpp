@@ -0,0 +1,154 @@
+// Stress and throughput benchmark for the work stealing deque and the job
+// system on top of it.
+//
+//   work_stealing_queue_bench [threads] [seconds]
+
+#include "job_system.h"
+#include "work_stealing_queue.h"
+
+#include <memory.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+using namespace knight;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct ThiefResult {
+  uint64_t stolen = 0u;
+  uint64_t empty = 0u;
+};
+
+// One owner pushes and pops in bursts the way a worker would, every other
+// thread does nothing but steal. Each item is counted once by whoever got it.
+void bench_queue(uint32_t thief_count, double seconds) {
+  const auto kBurst = 64u;
+
+  WorkStealingQueue<int *> queue;
+  std::atomic<bool> done{false};
+  std::vector<ThiefResult> results(thief_count);
+
+  std::vector<std::thread> thieves;
+  for (auto i = 0u; i < thief_count; ++i) {
+    thieves.emplace_back([&queue, &done, &result = results[i]] {
+      while (!done.load(std::memory_order_relaxed)) {
+        if (queue.steal() != nullptr) {
+          ++result.stolen;
+        } else {
+          ++result.empty;
+        }
+      }
+    });
+  }
+
+  uint64_t pushed = 0u;
+  uint64_t popped = 0u;
+  auto *item = reinterpret_cast<int *>(uintptr_t{1u});
+
+  auto start = Clock::now();
+  auto deadline = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds));
+  while (Clock::now() < deadline) {
+    for (auto i = 0u; i < kBurst; ++i) {
+      queue.push(item);
+    }
+    pushed += kBurst;
+
+    for (auto i = 0u; i < kBurst / 2u; ++i) {
+      if (queue.pop() != nullptr) {
+        ++popped;
+      }
+    }
+  }
+
+  while (queue.pop() != nullptr) {
+    ++popped;
+  }
+  done = true;
+
+  for (auto &&thief : thieves) {
+    thief.join();
+  }
+  auto elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+  uint64_t stolen = 0u;
+  uint64_t empty = 0u;
+  for (auto &&result : results) {
+    stolen += result.stolen;
+    empty += result.empty;
+  }
+
+  std::printf("queue: %u thieves, %.2f M items/s, %.1f%% stolen, %.1f%% of steals came back empty\n",
+    thief_count,
+    pushed / elapsed / 1e6,
+    pushed > 0u ? 100.0 * stolen / pushed : 0.0,
+    stolen + empty > 0u ? 100.0 * empty / (stolen + empty) : 0.0);
+
+  if (popped + stolen != pushed) {
+    std::printf("queue: lost or duplicated items, pushed %llu, taken %llu\n",
+      static_cast<unsigned long long>(pushed), static_cast<unsigned long long>(popped + stolen));
+    std::exit(EXIT_FAILURE);
+  }
+}
+
+void empty_job(Job *, const void *) { }
+
+// Wide frames of tiny jobs, the worst case for queue overhead
+void bench_job_system(uint32_t worker_count, double seconds) {
+  const auto kJobsPerFrame = 16384u;
+
+  JobSystem::Config config;
+  config.worker_count = worker_count;
+  JobSystem::initialize(config);
+
+  uint64_t jobs = 0u;
+  auto start = Clock::now();
+  auto deadline = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds));
+  while (Clock::now() < deadline) {
+    auto *root = JobSystem::create_job(empty_job);
+    for (auto i = 0u; i < kJobsPerFrame; ++i) {
+      JobSystem::run(JobSystem::create_job_as_child(root, empty_job));
+    }
+    JobSystem::wait(JobSystem::run(root));
+    jobs += kJobsPerFrame + 1u;
+  }
+  auto elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+  uint64_t attempts = 0u;
+  uint64_t failures = 0u;
+  for (auto i = 0u; i < JobSystem::thread_count(); ++i) {
+    auto statistics = JobSystem::steal_statistics(i);
+    attempts += statistics.attempts;
+    failures += statistics.failures;
+  }
+
+  std::printf("job system: %u workers, %.2f M jobs/s, %llu steal attempts, %.1f%% failed\n",
+    worker_count,
+    jobs / elapsed / 1e6,
+    static_cast<unsigned long long>(attempts),
+    attempts > 0u ? 100.0 * failures / attempts : 0.0);
+
+  JobSystem::shutdown();
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  auto thread_count = argc > 1 ? static_cast<uint32_t>(std::atoi(argv[1])) : std::thread::hardware_concurrency();
+  auto seconds = argc > 2 ? std::atof(argv[2]) : 2.0;
+  thread_count = std::max(thread_count, 1u);
+
+  foundation::memory_globals::init();
+
+  bench_queue(thread_count - 1u, seconds);
+  bench_job_system(thread_count, seconds);
+
+  foundation::memory_globals::shutdown();
+  return EXIT_SUCCESS;
+}
@@ -103,6 +103,39 @@ void BuildInjector(GameState &game_state) {
   game_state.injector = allocate_unique<di::Injector>(allocator, config.build_injector(allocator));
 }
 
+// Systems that do not touch the GL context, they run on the job system every
+// frame. Rendering stays on the main thread once they are done.
+void BuildScheduler(GameState &game_state) {
+  auto &allocator = memory_globals::default_allocator();
+  game_state.scheduler = allocate_unique<SystemScheduler>(allocator, allocator);
+
+  auto &scheduler = *game_state.scheduler;
+
+  scheduler.add("camera", [&game_state] {
+    auto entity_manager = game_state.injector->get_instance<EntityManager>();
+    auto entity = entity_manager->get(game_state.entity_id);
+
+    auto transform_component = game_state.injector->get_instance<TransformComponent>();
+    auto transform_instance = transform_component->lookup(*entity);
+
+    auto local = transform_component->local(transform_instance);
+
+    auto view_matrix = glm::translate(glm::mat4{1.0f}, glm::vec3{0, -8, -40});
+    auto projection_matrix = glm::perspective(45.0f, 4.0f / 3.0f, 0.1f, 100.f);
+
+    auto model_view_matrix = view_matrix * local;
+    game_state.mv_matrix_uniform->set_value(glm::value_ptr(model_view_matrix));
+
+    auto mvp_matrix = projection_matrix * model_view_matrix;
+    game_state.mvp_uniform->set_value(glm::value_ptr(mvp_matrix));
+
+    auto normal_matrix = glm::inverseTranspose(glm::mat3(model_view_matrix));
+    game_state.normal_matrix_uniform->set_value(glm::value_ptr(normal_matrix));
+  }).reads<EntityManager>()
+    .reads<TransformComponent>()
+    .writes<Material>();
+}
+
 namespace knight {
 namespace editor {
 
@@ -140,7 +173,12 @@ int get_file_id() {
 }
 
 extern "C" void Init(GLFWwindow &window) {
-  JobSystem::initialize();
+  // Keep the first CPU for the main thread, it owns the GL context
+  JobSystem::Config job_config;
+  job_config.reserved_cpus = {0u};
+  job_config.pin_workers = true;
+  job_config.topology_aware_stealing = true;
+  JobSystem::initialize(job_config);
 
   auto &allocator = memory_globals::default_allocator();
   auto &scratch_allocator = memory_globals::default_scratch_allocator();
@@ -210,6 +248,7 @@ extern "C" void Init(GLFWwindow &window) {
   auto transform_component = game_state.injector->get_instance<TransformComponent>();
   transform_component->add(*entity);
 
+  BuildScheduler(game_state);
 
   auto c = editor::Component::create("TransformComponent");
   auto tc = dynamic_cast<editor::TransformComponent *>(c.get());
@@ -494,6 +533,8 @@ extern "C" void UpdateAndRender() {
   auto delta_time = current_time - prev_time;
   prev_time = current_time;
 
+  JobSystem::begin_frame();
+
   glClear(GL_COLOR_BUFFER_BIT);
 
   ImGuiManager::begin_frame(delta_time);
@@ -536,30 +577,20 @@ extern "C" void UpdateAndRender() {
     ImGui::ShowTestWindow(&show_test_window);
   }
 
-  auto entity_manager = game_state.injector->get_instance<EntityManager>();
-  auto entity = entity_manager->get(game_state.entity_id);
+  game_state.scheduler->run();
+  JobSystem::run_main_thread_jobs();
 
+  auto entity_manager = game_state.injector->get_instance<EntityManager>();
   auto transform_component = game_state.injector->get_instance<TransformComponent>();
-  auto transform_instance = transform_component->lookup(*entity);
-
-  auto local = transform_component->local(transform_instance);
-
-  auto view_matrix = glm::translate(glm::mat4{1.0f}, glm::vec3{0, -8, -40});
-  auto projection_matrix = glm::perspective(45.0f, 4.0f / 3.0f, 0.1f, 100.f);
-
-  auto model_view_matrix = view_matrix * local;
-  game_state.mv_matrix_uniform->set_value(glm::value_ptr(model_view_matrix));
-
-  auto mvp_matrix = projection_matrix * model_view_matrix;
-  game_state.mvp_uniform->set_value(glm::value_ptr(mvp_matrix));
+  auto mesh_component = game_state.injector->get_instance<MeshComponent>();
 
-  auto normal_matrix = glm::inverseTranspose(glm::mat3(model_view_matrix));
-  game_state.normal_matrix_uniform->set_value(glm::value_ptr(normal_matrix));
+  transform_component->collect_garbage(*entity_manager);
+  mesh_component->collect_garbage(*entity_manager);
+  entity_manager->clear_destroyed();
 
   auto material_manager = game_state.injector->get_instance<MaterialManager>();
   material_manager->push_uniforms(*game_state.material);
 
-  auto mesh_component = game_state.injector->get_instance<MeshComponent>();
   mesh_component->render();
 
   ImGuiManager::end_frame();
@@ -568,6 +599,7 @@ extern "C" void UpdateAndRender() {
 }
 
 extern "C" void Shutdown() {
+  game_state.scheduler.reset();
   ImGuiManager::shutdown();
   JobSystem::shutdown();
 }
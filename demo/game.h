@@ -4,6 +4,7 @@
 #include "pointers.h"
 #include "types.h"
 #include "dependency_injection.h"
+#include "system_scheduler.h"
 
 #include <glm/glm.hpp>
 
@@ -27,6 +28,7 @@ struct GameState {
   Uniform<float, 3, 3> *normal_matrix_uniform;
 
   Pointer<di::Injector> injector;
+  Pointer<SystemScheduler> scheduler;
 
   char string_buff[256];
   char foo_buff[256];
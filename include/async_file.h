@@ -0,0 +1,91 @@
+#pragma once
+
+#include "job_system.h"
+
+#include <gsl.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+namespace knight {
+
+// A whole file read by AsyncFile, handed to the job that was waiting for it
+struct FileData {
+  const char *path;
+  std::unique_ptr<char[]> buffer;
+  std::size_t size;
+  bool success;
+
+  gsl::span<const char> data() const {
+    return {buffer.get(), static_cast<std::ptrdiff_t>(size)};
+  }
+};
+
+// Reads files without blocking the caller and hands them to JobSystem jobs
+// once they are in memory. Reads are batched through io_uring where the
+// kernel supports it and block on a small pool of threads otherwise.
+namespace AsyncFile {
+
+struct Config {
+  bool use_io_uring = true;
+
+  // Reads io_uring keeps in flight at once
+  uint32_t queue_depth = 64u;
+
+  // Threads doing blocking reads when io_uring is not available. They, or
+  // the io_uring thread, count towards JobSystem::Config::external_thread_count.
+  uint32_t thread_count = 2u;
+};
+
+// Goes between JobSystem::initialize() and JobSystem::shutdown(), shutdown
+// waits for every read still in flight
+void initialize(const Config &config = Config{});
+void shutdown();
+
+bool uses_io_uring();
+
+// Queues a read of the whole file. Once it is done, successfully or not, a
+// job calling function(FileData &) runs with the given affinity. The buffer
+// is freed after the job unless the function moved it out.
+template<typename F>
+JobHandle read_file(gsl::czstring<> path, F &&function, JobAffinity affinity = JobAffinity::Any);
+
+namespace detail {
+  struct ReadRequest;
+
+  ReadRequest *create_request(gsl::czstring<> path);
+  FileData &request_data(ReadRequest *request);
+  void free_request(ReadRequest *request);
+
+  // Runs job once the request completed
+  void submit(ReadRequest *request, Job *job);
+
+  template<typename F>
+  struct read_file_job {
+    ReadRequest *request;
+    F function;
+
+    void operator()(Job *) {
+      function(request_data(request));
+      free_request(request);
+    }
+  };
+} // namespace detail
+
+template<typename F>
+JobHandle read_file(gsl::czstring<> path, F &&function, JobAffinity affinity) {
+  auto *request = detail::create_request(path);
+  auto *job = JobSystem::create_closure_job(
+    detail::read_file_job<std::decay_t<F>>{request, std::forward<F>(function)});
+  JobSystem::set_affinity(job, affinity);
+
+  auto handle = JobSystem::handle_of(job);
+  detail::submit(request, job);
+  return handle;
+}
+
+} // namespace AsyncFile
+} // namespace knight
@@ -36,6 +36,9 @@ namespace knight {
 
 #define BOOL_STRING(value) (value ? "true" : "false")
 
+// platform dependent
+#define CACHE_LINE_SIZE 64
+
 #if defined(DEVELOPMENT)
   #define XASSERT(test, msg, ...) do {if (!(test)) error(__LINE__, __FILE__, \
       "\x1b[31mAssertion failed: %s\x1b[0m\n\n" msg, #test, ## __VA_ARGS__);} while (false)
@@ -64,6 +67,15 @@ inline void trace_abort() {
   abort();
 }
 
+// Hint to the processor that we are in a spin-wait loop
+inline void cpu_relax() {
+#if defined(__i386__) || defined(__x86_64__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+  asm volatile("yield");
+#endif
+}
+
 void *knight_malloc(size_t size);
 void knight_free(void *ptr);
 void knight_no_memory();
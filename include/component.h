@@ -1,8 +1,9 @@
 #pragma once
 
 #include "types.h"
+#include "entity_manager.h"
+#include "sparse_array.h"
 
-#include <hash.h>
 #include <memory_types.h>
 
 namespace knight {
@@ -15,10 +16,14 @@ class Component {
   Instance make_instance(int i);
   Instance lookup(Entity e);
 
+  // Destroys the instances of every entity in em.destroyed(). T provides
+  // destroy(uint32_t i).
+  void collect_garbage(const EntityManager &em);
+
  protected:
   Component(foundation::Allocator &alloc) : map_{alloc} { }
 
-  foundation::Hash<uint32_t> map_;
+  SparseArray<uint32_t> map_;
 };
 
 template<typename T>
@@ -28,7 +33,16 @@ auto Component<T>::make_instance(int i) -> Instance {
 
 template<typename T>
 auto Component<T>::lookup(Entity e) -> Instance {
-  return make_instance(foundation::hash::get(map_, e.id, 0u));
+  return make_instance(map_.get(e.id, 0u));
+}
+
+template<typename T>
+void Component<T>::collect_garbage(const EntityManager &em) {
+  for (auto &&id : em.destroyed()) {
+    if (map_.has(id)) {
+      static_cast<T *>(this)->destroy(map_.get(id, 0u));
+    }
+  }
 }
 
 } // namespace knight
@@ -1,11 +1,19 @@
 #pragma once
 
 #include "common.h"
+#include "event_count.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <new>
 #include <queue>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
+#include <type_traits>
+#include <utility>
 
 namespace knight {
 
@@ -33,6 +41,76 @@ class ConcurrentQueue {
   KNIGHT_DISALLOW_COPY_AND_ASSIGN(ConcurrentQueue);
 };
 
+// Same interface as ConcurrentQueue on a fixed size lock-free ring (Vyukov),
+// for pipelines moving lots of small items. push() and wait_pop() park on a
+// futex while the ring is full or empty, the try_ versions never block.
+template<typename T>
+class BoundedConcurrentQueue {
+ public:
+  // Rounded up to a power of two
+  explicit BoundedConcurrentQueue(size_t capacity = 1024);
+  ~BoundedConcurrentQueue();
+
+  void push(const T &item);
+  void push(T &&item);
+
+  // Leave item alone when the queue is full
+  bool try_push(const T &item);
+  bool try_push(T &&item);
+
+  void wait_pop(T &item);
+  bool try_pop(T &item);
+
+  // Moves as many of the count items in as fit, in order, and returns how
+  // many that were. Claims all slots at once, so it is one atomic operation
+  // however many items go in.
+  size_t try_push_bulk(T *items, size_t count);
+
+  // Pops up to count items into items and returns how many it got
+  size_t try_pop_bulk(T *items, size_t count);
+
+  size_t size() const;
+  bool empty() const;
+  size_t capacity() const { return mask_ + 1u; }
+
+ private:
+  struct Cell {
+    std::atomic<size_t> sequence;
+    std::aligned_storage_t<sizeof(T), alignof(T)> storage;
+
+    T *item() { return reinterpret_cast<T *>(&storage); }
+  };
+
+  template<typename U>
+  bool emplace(U &&item);
+
+  // The other side usually catches up within a few hundred cycles, parking
+  // costs a syscall on both sides
+  template<typename F>
+  bool spin(F &&attempt);
+
+  // Waits for whoever is still busy with a cell a bulk operation claimed,
+  // yielding in case they got preempted
+  void wait_for(const Cell &cell, size_t sequence);
+
+  // Reserves up to count consecutive positions starting at the returned one
+  size_t claim(std::atomic<size_t> &position, size_t count, size_t &claimed, bool pushing);
+
+  std::unique_ptr<Cell[]> cells_;
+  size_t mask_;
+
+  char padding0_[CACHE_LINE_SIZE];
+  std::atomic<size_t> enqueue_;
+  char padding1_[CACHE_LINE_SIZE];
+  std::atomic<size_t> dequeue_;
+  char padding2_[CACHE_LINE_SIZE];
+
+  EventCount not_empty_;
+  EventCount not_full_;
+
+  KNIGHT_DISALLOW_COPY_AND_ASSIGN(BoundedConcurrentQueue);
+};
+
 // Template implementations
 
 template<typename T>
@@ -60,7 +138,7 @@ void ConcurrentQueue<T>::wait_pop(T &item) {
   std::unique_lock<std::mutex> lk(mutex_);
   condition_.wait(lk, [this]{ return queue_.size() > 0; });
 
-  item = queue_.front();
+  item = std::move(queue_.front());
   queue_.pop();
 }
 
@@ -72,7 +150,7 @@ bool ConcurrentQueue<T>::try_pop(T &item) {
     return false;
   }
   
-  item = queue_.front();
+  item = std::move(queue_.front());
   queue_.pop();
 
   return true;
@@ -90,4 +168,233 @@ bool ConcurrentQueue<T>::empty() const {
   return queue_.empty();
 }
 
+template<typename T>
+BoundedConcurrentQueue<T>::BoundedConcurrentQueue(size_t capacity)
+  : enqueue_{0u},
+    dequeue_{0u} {
+  auto rounded = size_t{2u};
+  while (rounded < capacity) {
+    rounded *= 2u;
+  }
+
+  cells_.reset(new Cell[rounded]);
+  mask_ = rounded - 1u;
+  for (auto i = 0_z; i < rounded; ++i) {
+    cells_[i].sequence.store(i, std::memory_order_relaxed);
+  }
+}
+
+template<typename T>
+BoundedConcurrentQueue<T>::~BoundedConcurrentQueue() {
+  auto end = enqueue_.load(std::memory_order_relaxed);
+  for (auto i = dequeue_.load(std::memory_order_relaxed); i != end; ++i) {
+    cells_[i & mask_].item()->~T();
+  }
+}
+
+template<typename T>
+template<typename U>
+bool BoundedConcurrentQueue<T>::emplace(U &&item) {
+  auto position = enqueue_.load(std::memory_order_relaxed);
+  while (true) {
+    auto &cell = cells_[position & mask_];
+    auto difference = static_cast<std::ptrdiff_t>(cell.sequence.load(std::memory_order_acquire) - position);
+    if (difference == 0) {
+      if (enqueue_.compare_exchange_weak(position, position + 1u, std::memory_order_relaxed)) {
+        new (&cell.storage) T(std::forward<U>(item));
+        cell.sequence.store(position + 1u, std::memory_order_release);
+        not_empty_.notify();
+        return true;
+      }
+    } else if (difference < 0) {
+      return false;
+    } else {
+      position = enqueue_.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+template<typename T>
+template<typename F>
+bool BoundedConcurrentQueue<T>::spin(F &&attempt) {
+  const auto kSpinCount = 64u;
+  for (auto i = 0u; i < kSpinCount; ++i) {
+    if (attempt()) {
+      return true;
+    }
+    cpu_relax();
+  }
+
+  for (auto i = 0u; i < kSpinCount / 4u; ++i) {
+    std::this_thread::yield();
+    if (attempt()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+template<typename T>
+bool BoundedConcurrentQueue<T>::try_push(const T &item) {
+  return emplace(item);
+}
+
+template<typename T>
+bool BoundedConcurrentQueue<T>::try_push(T &&item) {
+  return emplace(std::move(item));
+}
+
+template<typename T>
+void BoundedConcurrentQueue<T>::push(const T &item) {
+  if (spin([&] { return emplace(item); })) {
+    return;
+  }
+
+  while (!emplace(item)) {
+    auto key = not_full_.prepare_wait();
+    if (emplace(item)) {
+      not_full_.cancel_wait();
+      return;
+    }
+    not_full_.wait(key);
+  }
+}
+
+template<typename T>
+void BoundedConcurrentQueue<T>::push(T &&item) {
+  // emplace() only moves from item once it has a slot
+  if (spin([&] { return emplace(std::move(item)); })) {
+    return;
+  }
+
+  while (!emplace(std::move(item))) {
+    auto key = not_full_.prepare_wait();
+    if (emplace(std::move(item))) {
+      not_full_.cancel_wait();
+      return;
+    }
+    not_full_.wait(key);
+  }
+}
+
+template<typename T>
+bool BoundedConcurrentQueue<T>::try_pop(T &item) {
+  auto position = dequeue_.load(std::memory_order_relaxed);
+  while (true) {
+    auto &cell = cells_[position & mask_];
+    auto difference = static_cast<std::ptrdiff_t>(cell.sequence.load(std::memory_order_acquire) - (position + 1u));
+    if (difference == 0) {
+      if (dequeue_.compare_exchange_weak(position, position + 1u, std::memory_order_relaxed)) {
+        item = std::move(*cell.item());
+        cell.item()->~T();
+        cell.sequence.store(position + mask_ + 1u, std::memory_order_release);
+        not_full_.notify();
+        return true;
+      }
+    } else if (difference < 0) {
+      return false;
+    } else {
+      position = dequeue_.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+template<typename T>
+void BoundedConcurrentQueue<T>::wait_pop(T &item) {
+  if (spin([&] { return try_pop(item); })) {
+    return;
+  }
+
+  while (!try_pop(item)) {
+    auto key = not_empty_.prepare_wait();
+    if (try_pop(item)) {
+      not_empty_.cancel_wait();
+      return;
+    }
+    not_empty_.wait(key);
+  }
+}
+
+template<typename T>
+void BoundedConcurrentQueue<T>::wait_for(const Cell &cell, size_t sequence) {
+  spin([&] { return cell.sequence.load(std::memory_order_acquire) == sequence; });
+  while (cell.sequence.load(std::memory_order_acquire) != sequence) {
+    std::this_thread::yield();
+  }
+}
+
+template<typename T>
+size_t BoundedConcurrentQueue<T>::claim(std::atomic<size_t> &position, size_t count, size_t &claimed, bool pushing) {
+  auto first = position.load(std::memory_order_relaxed);
+  while (true) {
+    // The other end may be a little behind, that only makes us claim less
+    auto other = pushing ? dequeue_.load(std::memory_order_acquire) : enqueue_.load(std::memory_order_acquire);
+    auto available = pushing ? capacity() - (first - other) : other - first;
+    if (static_cast<std::ptrdiff_t>(available) <= 0) {
+      claimed = 0u;
+      return first;
+    }
+
+    claimed = std::min(count, available);
+    if (position.compare_exchange_weak(first, first + claimed, std::memory_order_relaxed)) {
+      return first;
+    }
+  }
+}
+
+template<typename T>
+size_t BoundedConcurrentQueue<T>::try_push_bulk(T *items, size_t count) {
+  size_t claimed;
+  auto first = claim(enqueue_, count, claimed, true);
+
+  for (auto i = 0_z; i < claimed; ++i) {
+    auto &cell = cells_[(first + i) & mask_];
+
+    // A consumer that claimed this cell a lap ago may still be moving out
+    wait_for(cell, first + i);
+
+    new (&cell.storage) T(std::move(items[i]));
+    cell.sequence.store(first + i + 1u, std::memory_order_release);
+  }
+
+  if (claimed > 0u) {
+    not_empty_.notify(static_cast<uint32_t>(claimed));
+  }
+  return claimed;
+}
+
+template<typename T>
+size_t BoundedConcurrentQueue<T>::try_pop_bulk(T *items, size_t count) {
+  size_t claimed;
+  auto first = claim(dequeue_, count, claimed, false);
+
+  for (auto i = 0_z; i < claimed; ++i) {
+    auto &cell = cells_[(first + i) & mask_];
+
+    // The producer of this cell may still be moving in
+    wait_for(cell, first + i + 1u);
+
+    items[i] = std::move(*cell.item());
+    cell.item()->~T();
+    cell.sequence.store(first + i + mask_ + 1u, std::memory_order_release);
+  }
+
+  if (claimed > 0u) {
+    not_full_.notify(static_cast<uint32_t>(claimed));
+  }
+  return claimed;
+}
+
+template<typename T>
+size_t BoundedConcurrentQueue<T>::size() const {
+  auto dequeue = dequeue_.load(std::memory_order_acquire);
+  auto enqueue = enqueue_.load(std::memory_order_acquire);
+  return enqueue > dequeue ? enqueue - dequeue : 0u;
+}
+
+template<typename T>
+bool BoundedConcurrentQueue<T>::empty() const {
+  return size() == 0u;
+}
+
 } // namespace knight
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace knight {
+namespace cpu_topology {
+
+const int32_t kUnknown = -1;
+
+// Logical CPUs this process is allowed to run on
+std::vector<uint32_t> available_cpus();
+
+// CPUs sharing a last level cache report the same id
+int32_t cache_group(uint32_t cpu);
+
+int32_t numa_node(uint32_t cpu);
+
+// Restricts the calling thread to a single CPU, false if that is not possible
+bool pin_current_thread(uint32_t cpu);
+
+} // namespace cpu_topology
+} // namespace knight
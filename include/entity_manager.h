@@ -10,17 +10,47 @@ namespace knight {
 
 class EntityManager {
  public:
-  EntityManager(foundation::Allocator &allocator) : entities_{allocator} { }
+  EntityManager(foundation::Allocator &allocator)
+    : entities_{allocator},
+      destroyed_{allocator} { }
 
   Entity::ID create();
   Entity *get(Entity::ID id) const;
   void destroy(Entity::ID id);
 
+  // Creates as many entities as ids has room for, or destroys all of ids.
+  // Meant for level loads and mass despawns.
+  void create(gsl::span<Entity::ID> ids);
+  void destroy(gsl::span<const Entity::ID> ids);
+
   bool alive(Entity::ID id) const;
   bool alive(const Entity &e) const;
 
+  // Live entities, packed together in no particular order. Destroying an
+  // entity moves the last one into its place.
+  gsl::span<const Entity::ID> entities() const { return entities_.ids(); }
+  size_t size() const { return entities_.size(); }
+
+  // Entities destroyed since the last clear_destroyed(). Components clean up
+  // after them in collect_garbage(), clear_destroyed() is called once they
+  // all have, at the end of the frame. Their indices are only reused after
+  // that, so a new entity cannot take over a component entry that is still
+  // waiting to be collected.
+  gsl::span<const Entity::ID> destroyed() const {
+    return {destroyed_.data(), static_cast<std::ptrdiff_t>(destroyed_.size())};
+  }
+  void clear_destroyed();
+
+  // Calls f(Entity::ID) for every live entity, f may destroy the entity it
+  // was given
+  template<typename F>
+  void for_each(F &&f) const {
+    entities_.for_each([&f](const Entity &e) { f(e.id); });
+  }
+
  private:
   SlotMap<Entity, Entity::ID> entities_;
+  Vector<Entity::ID> destroyed_;
 
   KNIGHT_DISALLOW_COPY_AND_ASSIGN(EntityManager);
 };
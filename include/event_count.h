@@ -0,0 +1,80 @@
+#pragma once
+
+#include "common.h"
+#include "futex.h"
+
+#include <atomic>
+#include <cstdint>
+
+namespace knight {
+
+// Lets threads sleep until "something happened" without a lock on the
+// notifying side. A waiter announces itself with prepare_wait(), re-checks its
+// condition and then either commits with wait() or backs out with
+// cancel_wait(). notify() is a fence and a load when nobody is sleeping.
+class EventCount {
+ public:
+  using Key = uint32_t;
+
+  EventCount() : epoch_{0u}, waiters_{0u} { }
+
+  Key prepare_wait();
+  void cancel_wait();
+  void wait(Key key);
+
+  void notify(uint32_t count = 1u);
+  void notify_all();
+
+  uint32_t waiter_count() const;
+
+ private:
+  bool has_waiters();
+
+  std::atomic<uint32_t> epoch_;
+  std::atomic<uint32_t> waiters_;
+
+  KNIGHT_DISALLOW_COPY_AND_ASSIGN(EventCount);
+};
+
+inline auto EventCount::prepare_wait() -> Key {
+  waiters_.fetch_add(1u, std::memory_order_seq_cst);
+  return epoch_.load(std::memory_order_acquire);
+}
+
+inline void EventCount::cancel_wait() {
+  waiters_.fetch_sub(1u, std::memory_order_relaxed);
+}
+
+inline void EventCount::wait(Key key) {
+  while (epoch_.load(std::memory_order_acquire) == key) {
+    futex::wait(epoch_, key);
+  }
+  waiters_.fetch_sub(1u, std::memory_order_relaxed);
+}
+
+inline bool EventCount::has_waiters() {
+  // Pairs with the fetch_add in prepare_wait(), either the waiter sees the
+  // state published before notify() or we see the waiter
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  return waiters_.load(std::memory_order_relaxed) != 0u;
+}
+
+inline void EventCount::notify(uint32_t count) {
+  if (has_waiters()) {
+    epoch_.fetch_add(1u, std::memory_order_release);
+    futex::wake(epoch_, count);
+  }
+}
+
+inline void EventCount::notify_all() {
+  if (has_waiters()) {
+    epoch_.fetch_add(1u, std::memory_order_release);
+    futex::wake_all(epoch_);
+  }
+}
+
+inline uint32_t EventCount::waiter_count() const {
+  return waiters_.load(std::memory_order_relaxed);
+}
+
+} // namespace knight
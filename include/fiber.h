@@ -0,0 +1,51 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstddef>
+
+#if defined(__linux__)
+  #define KNIGHT_HAS_FIBERS 1
+  #include <ucontext.h>
+#else
+  #define KNIGHT_HAS_FIBERS 0
+#endif
+
+#if KNIGHT_HAS_FIBERS
+
+namespace knight {
+
+// A user mode thread of execution with its own stack. Fibers never return,
+// they only ever switch to another fiber.
+class Fiber {
+ public:
+  using Function = void(*)(void *);
+
+  static const std::size_t kDefaultStackSize = 256_kib;
+
+  // Captures the calling thread's own context, so it can be switched back to
+  Fiber();
+  Fiber(Function function, void *argument, std::size_t stack_size = kDefaultStackSize);
+
+  ~Fiber();
+
+  // Saves the current context into from and resumes to
+  static void switch_to(Fiber &from, Fiber &to);
+
+ private:
+  static void entry(unsigned int high, unsigned int low);
+
+  ucontext_t context_;
+  void *stack_;
+  std::size_t stack_size_;
+
+  Function function_;
+  void *argument_;
+
+  KNIGHT_DISALLOW_COPY_AND_ASSIGN(Fiber);
+  KNIGHT_DISALLOW_MOVE_AND_ASSIGN(Fiber);
+};
+
+} // namespace knight
+
+#endif
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#if defined(__linux__)
+  #include <linux/futex.h>
+  #include <sys/syscall.h>
+  #include <unistd.h>
+  #include <cerrno>
+  #include <climits>
+  #include <ctime>
+#else
+  #include <mutex>
+  #include <condition_variable>
+#endif
+
+namespace knight {
+namespace futex {
+
+// Blocks the calling thread while word == expected. Wake ups may be spurious,
+// callers must re-check their condition.
+void wait(std::atomic<uint32_t> &word, uint32_t expected);
+
+// Same as wait, but gives up after timeout. Returns false if it timed out.
+bool wait_for(std::atomic<uint32_t> &word, uint32_t expected, std::chrono::nanoseconds timeout);
+
+// Wakes at most count threads blocked on word
+void wake(std::atomic<uint32_t> &word, uint32_t count);
+void wake_all(std::atomic<uint32_t> &word);
+
+#if defined(__linux__)
+
+namespace detail {
+  inline long futex(std::atomic<uint32_t> &word, int op, uint32_t value, const timespec *timeout = nullptr) {
+    static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "Futex word must be 32 bits");
+    return syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), op | FUTEX_PRIVATE_FLAG, value, timeout, nullptr, 0);
+  }
+} // namespace detail
+
+inline void wait(std::atomic<uint32_t> &word, uint32_t expected) {
+  detail::futex(word, FUTEX_WAIT, expected);
+}
+
+inline bool wait_for(std::atomic<uint32_t> &word, uint32_t expected, std::chrono::nanoseconds timeout) {
+  auto seconds = std::chrono::duration_cast<std::chrono::seconds>(timeout);
+  timespec relative;
+  relative.tv_sec = static_cast<time_t>(seconds.count());
+  relative.tv_nsec = static_cast<long>((timeout - seconds).count());
+
+  return detail::futex(word, FUTEX_WAIT, expected, &relative) == 0 || errno != ETIMEDOUT;
+}
+
+inline void wake(std::atomic<uint32_t> &word, uint32_t count) {
+  detail::futex(word, FUTEX_WAKE, std::min<uint32_t>(count, INT_MAX));
+}
+
+inline void wake_all(std::atomic<uint32_t> &word) {
+  detail::futex(word, FUTEX_WAKE, INT_MAX);
+}
+
+#else
+
+// Without a futex we park on one of a fixed set of condition variables chosen
+// by address, the same way a parking lot does it
+namespace detail {
+  struct Bucket {
+    std::mutex mutex;
+    std::condition_variable condition;
+  };
+
+  inline Bucket &bucket(const void *address) {
+    const std::size_t kBucketCount = 64;
+    static Bucket buckets[kBucketCount];
+    auto hash = reinterpret_cast<std::uintptr_t>(address) >> 2;
+    return buckets[(hash ^ (hash >> 6)) % kBucketCount];
+  }
+} // namespace detail
+
+inline void wait(std::atomic<uint32_t> &word, uint32_t expected) {
+  auto &bucket = detail::bucket(&word);
+  std::unique_lock<std::mutex> lock{bucket.mutex};
+  if (word.load(std::memory_order_relaxed) == expected) {
+    bucket.condition.wait(lock);
+  }
+}
+
+inline bool wait_for(std::atomic<uint32_t> &word, uint32_t expected, std::chrono::nanoseconds timeout) {
+  auto &bucket = detail::bucket(&word);
+  std::unique_lock<std::mutex> lock{bucket.mutex};
+  if (word.load(std::memory_order_relaxed) != expected) {
+    return true;
+  }
+  return bucket.condition.wait_for(lock, timeout) == std::cv_status::no_timeout;
+}
+
+inline void wake(std::atomic<uint32_t> &word, uint32_t count) {
+  // Buckets are shared between addresses so everyone has to re-check
+  wake_all(word);
+}
+
+inline void wake_all(std::atomic<uint32_t> &word) {
+  auto &bucket = detail::bucket(&word);
+  {
+    std::lock_guard<std::mutex> lock{bucket.mutex};
+  }
+  bucket.condition.notify_all();
+}
+
+#endif
+
+} // namespace futex
+} // namespace knight
@@ -1,56 +1,357 @@
 #pragma once
 
+#include "common.h"
 #include "memory_block.h"
 
+#include <gsl.h>
+
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 namespace knight {
 
 struct Job;
+struct JobEdge;
+struct JobCounter;
 
 using JobFunction = void(*)(Job *, const void *);
 
-// platform dependent
-#define CACHE_LINE_SIZE 64
+// Each worker keeps one queue per priority and always drains higher ones
+// first. Background jobs additionally only run while the frame's background
+// budget lasts.
+enum class JobPriority : uint8_t {
+  High,
+  Normal,
+  Background
+};
+
+const uint32_t kJobPriorityCount = 3u;
+
+// Jobs bound to a thread never get stolen, only that thread runs them while
+// it waits or at JobSystem::run_main_thread_jobs()
+enum class JobAffinity : uint8_t {
+  Any,
+  MainThread // owns the GL context
+};
 
 struct Job {
   alignas(CACHE_LINE_SIZE) JobFunction function;
-  Job *parent;
+  union {
+    Job *parent;
+    Job *next_free; // only used while the job sits in its pool
+  };
+  std::atomic<JobEdge *> continuations;
   std::atomic<int32_t> unfinished_jobs;
+  std::atomic<int32_t> dependencies;
+  std::atomic<uint32_t> generation;
+  uint16_t pool;
+  JobPriority priority;
+  bool spilled : 1; // data only points at the payload, see detail::allocate_payload
+  bool main_thread : 1; // see JobAffinity
   char data[
     CACHE_LINE_SIZE -
     sizeof(JobFunction) -
     sizeof(Job *) -
-    sizeof(std::atomic<int32_t>)];
+    sizeof(std::atomic<JobEdge *>) -
+    sizeof(std::atomic<int32_t>) -
+    sizeof(std::atomic<int32_t>) -
+    sizeof(std::atomic<uint32_t>) -
+    sizeof(uint16_t) -
+    sizeof(JobPriority) -
+    sizeof(bool)];
+};
+
+static_assert(sizeof(Job) == CACHE_LINE_SIZE, "Job must fill exactly one cache line");
+
+// Jobs are recycled as soon as they finish, a handle remembers which
+// incarnation of the slot it refers to. The priority is copied too, the job
+// itself may already belong to someone else by the time a waiter needs it.
+struct JobHandle {
+  const Job *job;
+  uint32_t generation;
+  JobPriority priority;
 };
 
 
 namespace JobSystem {
 
-void initialize();
+struct StealPolicy {
+  // Number of randomly chosen queues probed before a thread gives up
+  uint32_t victim_count = 4;
+
+  // Maximum number of jobs taken from a victim in a single steal, the extra
+  // jobs are moved into the thief's own queue
+  uint32_t batch_size = 1;
+};
+
+enum class WaitMode {
+  // wait() keeps running other jobs on top of the waiting one until it is done
+  Help,
+
+  // Workers run jobs on fibers, a job calling wait() has its fiber suspended
+  // and resumed on any worker once the job it waits for is done. Falls back
+  // to Help where fibers are not supported, threads that are not workers
+  // always help.
+  Fiber
+};
+
+struct Config {
+  // Zero starts one worker per available CPU that is not reserved, or one
+  // per entry of worker_cpus when that is given
+  uint32_t worker_count = 0u;
+
+  // CPUs left alone for threads outside the job system, such as the main/GL
+  // or the network thread
+  std::vector<uint32_t> reserved_cpus;
+
+  // Pins every worker to its own CPU out of the ones not reserved. A list of
+  // CPUs, used in worker order, takes precedence.
+  bool pin_workers = false;
+  std::vector<uint32_t> worker_cpus;
+
+  // Pinned workers steal from workers sharing their last level cache first,
+  // then from their NUMA node and only then from everyone else
+  bool topology_aware_stealing = false;
+
+  // How many threads outside the job system, such as network, loader or
+  // editor threads, may create and run jobs at the same time. Their jobs are
+  // handed to the workers through inboxes.
+  uint32_t external_thread_count = 4u;
+
+  WaitMode wait_mode = WaitMode::Help;
+};
+
+struct StealStatistics {
+  uint64_t attempts;
+  uint64_t successes;
+  uint64_t failures;
+};
+
+void initialize(const Config &config = Config{});
 void shutdown();
 
-bool has_job_completed(const Job *job);
+bool has_job_completed(JobHandle handle);
 
+// Handle to the current incarnation of job, which must not have finished
+// yet. For code that hands a job to the job system some other way than run().
+JobHandle handle_of(const Job *job);
+
+// Jobs start out as JobPriority::Normal, children take their parent's priority
 Job *create_job(JobFunction function);
 Job *create_job_as_child(Job *parent, JobFunction function);
 
+void set_priority(Job *job, JobPriority priority);
+
+// Jobs start out as JobAffinity::Any, children do not inherit it
+void set_affinity(Job *job, JobAffinity affinity);
+
+// Arguments are packed into the job and handed to function as data. Whatever
+// does not fit into Job::data goes to the calling thread's frame arena. They
+// are copied as bytes, so they have to be trivially copyable.
+template<typename ...Args>
+Job *create_job(JobFunction function, Args&&... args);
+
+template<typename ...Args>
+Job *create_job_as_child(Job *parent, JobFunction function, Args&&... args);
+
+// Runs function(job). The callable is moved into the job, or into the
+// calling thread's frame arena if it does not fit, and destroyed once it has
+// run, so it may own non-trivial state.
+template<typename F>
+Job *create_closure_job(F &&function);
+
+template<typename F>
+Job *create_closure_job_as_child(Job *parent, F &&function);
+
+// Queues the job, or once it has dependencies, lets the last of them queue it
+JobHandle run(Job *job);
+
+// Runs other jobs no less important than the one waited for until it is done
+void wait(JobHandle handle);
+
+// Counters start at zero and go up by one for every job run against them,
+// and down again as those jobs finish. They come from a pool and can be kept
+// across frames, until freed.
+JobCounter *create_counter();
+void free_counter(JobCounter *counter);
+int32_t counter_value(const JobCounter *counter);
+
+// Like run(job), with counter raised until the job has finished
+JobHandle run(Job *job, JobCounter *counter);
+
+// Runs other jobs, or suspends the calling fiber, until counter is down to
+// value or below
+void wait(JobCounter *counter, int32_t value = 0);
+
+// Holds continuation back until job has finished. job must not have finished
+// yet when this is called, or at least still be running, and continuation
+// must not have been run yet.
+void add_continuation(Job *job, Job *continuation);
+void add_dependency(Job *job, Job *prerequisite);
+
+// Calls function(i) for every i in [begin, end). The range is split in half
+// whenever the calling worker's queue runs dry, so thieves always walk away
+// with the biggest piece left, otherwise it is worked through grain indices
+// at a time.
+template<typename F>
+void parallel_for(uint32_t begin, uint32_t end, uint32_t grain, F &&function);
+
+// Calls function(subspan) on pieces of span no bigger than grain
+template<typename T, typename F>
+void parallel_for(gsl::span<T> span, uint32_t grain, F &&function);
+
+// May be called at any time, workers pick the policy up with their next steal
+void set_steal_policy(const StealPolicy &policy);
+
+// Limits how much time background jobs may take up between two calls to
+// begin_frame(), summed over every thread. There is no limit by default.
+void set_background_budget(std::chrono::microseconds budget);
+void clear_background_budget();
+void begin_frame();
+
+// Runs every job bound to the main thread that is ready, call it from the main
+// thread at points where GL work may happen, such as before rendering
+void run_main_thread_jobs();
+
+// Threads the job system keeps state for, including outside threads
+uint32_t thread_count();
+StealStatistics steal_statistics(uint32_t thread_index);
+void reset_steal_statistics();
+
+namespace detail {
+  // Memory for a payload that does not fit into the job. It comes from the
+  // calling thread's frame arena and is given back once the job has run.
+  // Arenas are only recycled on a later frame, after all of their payloads
+  // are gone, so this does not allocate once they have warmed up.
+  void *allocate_payload(Job *job, std::size_t size, std::size_t align);
+
+  template<typename ...Args>
+  void pack_payload(Job *job, Args&&... args) {
+    // Payloads are copied byte by byte and never destroyed, anything that
+    // owns state belongs in create_closure_job
+    static_assert(all_trivially_copyable<std::decay_t<Args>...>::value,
+      "Job arguments must be trivially copyable, use create_closure_job for anything else");
+
+    const auto size = sizeof_sum(args...);
+    if (size <= sizeof(job->data)) {
+      memory_block::pack_data(job->data, std::forward<Args>(args)...);
+    } else {
+      auto *payload = static_cast<char *>(allocate_payload(job, size, 1u));
+      memory_block::detail::pack_data_helper(payload, std::forward<Args>(args)...);
+    }
+  }
+
+  template<typename F>
+  void closure_job(Job *job, const void *data) {
+    auto &function = *static_cast<F *>(const_cast<void *>(data));
+    function(job);
+    function.~F();
+  }
+
+  template<typename F>
+  Job *store_closure(Job *job, F &&function) {
+    using Closure = std::decay_t<F>;
+
+    void *storage = job->data;
+    if (sizeof(Closure) > sizeof(job->data) || alignof(Closure) > alignof(Job *)) {
+      storage = allocate_payload(job, sizeof(Closure), alignof(Closure));
+    }
+
+    new (storage) Closure(std::forward<F>(function));
+    return job;
+  }
+
+  // True when the calling thread has nothing queued that a thief could take
+  bool should_split();
+
+  template<typename F>
+  struct ParallelForRange {
+    const F *function;
+    uint32_t begin;
+    uint32_t end;
+    uint32_t grain;
+  };
+
+  template<typename F>
+  void parallel_for_job(Job *job, const void *data) {
+    ParallelForRange<F> range;
+    memory_block::unpack_data(data, range);
+
+    while (range.begin < range.end) {
+      if (range.end - range.begin >= 2u * range.grain && should_split()) {
+        auto middle = range.begin + (range.end - range.begin) / 2u;
+        auto upper = ParallelForRange<F>{range.function, middle, range.end, range.grain};
+        run(create_job_as_child(job, parallel_for_job<F>, upper));
+        range.end = middle;
+        continue;
+      }
+
+      auto chunk_end = std::min(range.begin + range.grain, range.end);
+      (*range.function)(range.begin, chunk_end);
+      range.begin = chunk_end;
+    }
+  }
+
+  // Runs function(chunk_begin, chunk_end) over the range and waits for it.
+  // Only a pointer to function travels with the jobs, it stays on our stack.
+  template<typename F>
+  void parallel_for_chunks(uint32_t begin, uint32_t end, uint32_t grain, const F &function) {
+    if (begin >= end) {
+      return;
+    }
+
+    auto range = ParallelForRange<F>{&function, begin, end, std::max(grain, 1u)};
+    wait(run(create_job(parallel_for_job<F>, range)));
+  }
+} // namespace detail
+
 template<typename ...Args>
 Job *create_job(JobFunction function, Args&&... args) {
   auto job = create_job(function);
-  memory_block::pack_data(job->data, std::forward<Args>(args)...);
+  detail::pack_payload(job, std::forward<Args>(args)...);
   return job;
 }
 
 template<typename ...Args>
 Job *create_job_as_child(Job *parent, JobFunction function, Args&&... args) {
   auto job = create_job_as_child(parent, function);
-  memory_block::pack_data(job->data, std::forward<Args>(args)...);
+  detail::pack_payload(job, std::forward<Args>(args)...);
   return job;
 }
 
-void run(Job *job);
-void wait(const Job *job);
+template<typename F>
+Job *create_closure_job(F &&function) {
+  auto *job = create_job(detail::closure_job<std::decay_t<F>>);
+  return detail::store_closure(job, std::forward<F>(function));
+}
+
+template<typename F>
+Job *create_closure_job_as_child(Job *parent, F &&function) {
+  auto *job = create_job_as_child(parent, detail::closure_job<std::decay_t<F>>);
+  return detail::store_closure(job, std::forward<F>(function));
+}
+
+template<typename F>
+void parallel_for(uint32_t begin, uint32_t end, uint32_t grain, F &&function) {
+  detail::parallel_for_chunks(begin, end, grain, [&function](uint32_t chunk_begin, uint32_t chunk_end) {
+    for (auto i = chunk_begin; i < chunk_end; ++i) {
+      function(i);
+    }
+  });
+}
+
+template<typename T, typename F>
+void parallel_for(gsl::span<T> span, uint32_t grain, F &&function) {
+  auto size = static_cast<uint32_t>(span.size());
+  detail::parallel_for_chunks(0u, size, grain, [&function, span](uint32_t chunk_begin, uint32_t chunk_end) {
+    function(span.subspan(chunk_begin, chunk_end - chunk_begin));
+  });
+}
 
 } // namespace JobSystem
 } // namespace knight
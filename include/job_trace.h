@@ -0,0 +1,75 @@
+#pragma once
+
+#include "job_system.h"
+
+#include <atomic>
+#include <cstdint>
+
+#if defined(__i386__) || defined(__x86_64__)
+  #include <x86intrin.h>
+#else
+  #include <chrono>
+#endif
+
+namespace knight {
+
+// Records what JobSystem threads are doing into one ring buffer per thread,
+// cheap enough to stay compiled in. The rings can be written out as Chrome
+// trace_event JSON (chrome://tracing, Perfetto) at any time or at shutdown.
+namespace JobTrace {
+
+enum class Event : uint8_t {
+  Begin,
+  End,
+  Steal,
+  Sleep,
+  Wake
+};
+
+// Events kept per thread, older ones get overwritten. Takes effect on the
+// next JobSystem::initialize.
+void set_capacity(uint32_t events_per_thread);
+
+void set_enabled(bool enabled);
+bool enabled();
+
+// Shown instead of the function address for every job running function
+void set_label(JobFunction function, const char *label);
+
+// Writes everything recorded so far, returns false if the file could not be
+// written
+bool write(const char *path);
+
+// Writes the trace from JobSystem::shutdown, nullptr turns it off again
+void write_on_shutdown(const char *path);
+
+// Called by JobSystem, the last external_thread_count threads are the slots
+// handed to threads outside the job system
+void initialize(uint32_t thread_count, uint32_t external_thread_count);
+void shutdown();
+
+namespace detail {
+
+extern std::atomic<bool> enabled;
+
+void record(uint32_t thread_index, Event event, const void *address, uint64_t timestamp);
+
+inline uint64_t timestamp() {
+#if defined(__i386__) || defined(__x86_64__)
+  return __rdtsc();
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+} // namespace detail
+
+inline void record(uint32_t thread_index, Event event, const void *address = nullptr) {
+  if (detail::enabled.load(std::memory_order_relaxed)) {
+    detail::record(thread_index, event, address, detail::timestamp());
+  }
+}
+
+} // namespace JobTrace
+} // namespace knight
@@ -93,7 +93,8 @@ inline void unpack_data(const void *ptr) { }
 
 template<typename T, typename ...Args>
 void unpack_data(const void *ptr, T &value, Args&&... args) {
-  value = *reinterpret_cast<T *>(const_cast<void *>(ptr));
+  // Packed data carries no alignment guarantees
+  memcpy(&value, ptr, sizeof(T));
   auto char_ptr = (const char *)ptr;
   unpack_data(char_ptr + sizeof(T), std::forward<Args>(args)...);
 }
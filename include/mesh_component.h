@@ -25,8 +25,6 @@ class MeshComponent : public Component<MeshComponent> {
 
   void render() const;
 
-  // void GC(const EntityManager &em);
-
  private:
   Vector<InstanceData> data_;
 };
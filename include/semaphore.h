@@ -1,47 +1,155 @@
 #pragma once
 
-#include <mutex>
-#include <condition_variable>
+#include "common.h"
+#include "futex.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <limits>
 #include <algorithm>
 
 namespace knight {
 
+// Counting semaphore on an atomic count. Signalling and waiting without
+// contention is a single atomic operation, a waiter spins for a little while
+// before it parks on a futex.
 class Semaphore {
  public:
   Semaphore(int count = 0, int max = std::numeric_limits<int>::max())
     : count_{count},
+      tokens_{0u},
       max_{max} { }
 
-  void notify() {
-    {
-      std::lock_guard<std::mutex> lock{mutex_};
-      count_ = std::min(count_ + 1, max_);
+  // Adds count, but never beyond max, and wakes up to that many waiters
+  void notify(int count = 1);
+
+  void wait();
+  bool try_wait();
+
+  // Returns false if the timeout passed before the semaphore was signalled
+  template<typename Rep, typename Period>
+  bool wait_for(const std::chrono::duration<Rep, Period> &timeout);
+
+ private:
+  static const int kSpinCount = 64;
+
+  bool spin();
+
+  // Tokens are handed from notify() to threads parked in wait()
+  bool take_token();
+  void wait_for_token();
+
+  // Negative while threads are waiting, one for each of them
+  std::atomic<int> count_;
+  std::atomic<uint32_t> tokens_;
+  const int max_;
+
+  KNIGHT_DISALLOW_COPY_AND_ASSIGN(Semaphore);
+};
+
+inline void Semaphore::notify(int count) {
+  int old_count;
+  int added;
+  if (max_ == std::numeric_limits<int>::max()) {
+    added = count;
+    old_count = count_.fetch_add(count, std::memory_order_release);
+  } else {
+    old_count = count_.load(std::memory_order_relaxed);
+    do {
+      added = static_cast<int>(std::min<int64_t>(int64_t{old_count} + count, max_) - old_count);
+      if (added <= 0) {
+        return;
+      }
+    } while (!count_.compare_exchange_weak(old_count, old_count + added, std::memory_order_release, std::memory_order_relaxed));
+  }
+
+  auto waiting = std::min(added, -old_count);
+  if (waiting > 0) {
+    tokens_.fetch_add(static_cast<uint32_t>(waiting), std::memory_order_release);
+    futex::wake(tokens_, static_cast<uint32_t>(waiting));
+  }
+}
+
+inline bool Semaphore::try_wait() {
+  auto old_count = count_.load(std::memory_order_relaxed);
+  while (old_count > 0) {
+    if (count_.compare_exchange_weak(old_count, old_count - 1, std::memory_order_acquire, std::memory_order_relaxed)) {
+      return true;
     }
-    condition_.notify_one();
   }
+  return false;
+}
 
-  void wait() {
-    std::unique_lock<std::mutex> lock{mutex_};
-    condition_.wait(lock, [this]{ return count_ > 0; });
-    count_--;
+inline bool Semaphore::spin() {
+  for (auto i = 0; i < kSpinCount; ++i) {
+    if (try_wait()) {
+      return true;
+    }
+    cpu_relax();
   }
+  return false;
+}
 
-  bool try_wait() {
-    std::lock_guard<std::mutex> lock{mutex_};
-    if (count_ > 0) {
-      count_--;
+inline bool Semaphore::take_token() {
+  auto tokens = tokens_.load(std::memory_order_relaxed);
+  while (tokens > 0u) {
+    if (tokens_.compare_exchange_weak(tokens, tokens - 1u, std::memory_order_acquire, std::memory_order_relaxed)) {
       return true;
-    } else {
-      return false;
     }
   }
+  return false;
+}
 
- private:
-  std::mutex mutex_;
-  std::condition_variable condition_;
-  int count_;
-  const int max_;
-};
+inline void Semaphore::wait_for_token() {
+  while (!take_token()) {
+    futex::wait(tokens_, 0u);
+  }
+}
+
+inline void Semaphore::wait() {
+  if (spin()) {
+    return;
+  }
+
+  if (count_.fetch_sub(1, std::memory_order_acquire) > 0) {
+    return;
+  }
+  wait_for_token();
+}
+
+template<typename Rep, typename Period>
+bool Semaphore::wait_for(const std::chrono::duration<Rep, Period> &timeout) {
+  using Clock = std::chrono::steady_clock;
+
+  if (spin()) {
+    return true;
+  }
+
+  auto deadline = Clock::now() + std::chrono::duration_cast<Clock::duration>(timeout);
+  if (count_.fetch_sub(1, std::memory_order_acquire) > 0) {
+    return true;
+  }
+
+  while (!take_token()) {
+    auto now = Clock::now();
+    if (now >= deadline) {
+      // Back out, unless a notify() already counted us and a token is on
+      // its way
+      auto old_count = count_.load(std::memory_order_relaxed);
+      while (old_count < 0) {
+        if (count_.compare_exchange_weak(old_count, old_count + 1, std::memory_order_relaxed)) {
+          return false;
+        }
+      }
+
+      wait_for_token();
+      return true;
+    }
+
+    futex::wait_for(tokens_, 0u, deadline - now);
+  }
+  return true;
+}
 
 } // namespace knight
@@ -1,9 +1,11 @@
 #pragma once
 
 #include "common.h"
+#include "pointers.h"
 #include "vector.h"
 
 #include <memory.h>
+#include <gsl.h>
 
 #include <cstddef>
 
@@ -15,8 +17,11 @@ class SlotMap {
   const size_t kChunkSize = 256;
 
   SlotMap(foundation::Allocator &allocator)
-    : slot_table_{allocator},
-      free_list_{allocator} { }
+    : allocator_{&allocator},
+      slot_table_{allocator},
+      free_list_{allocator},
+      dense_{allocator},
+      dense_index_{allocator} { }
 
   SlotMap(const SlotMap &) = delete;
   SlotMap(SlotMap &&) = default;
@@ -28,34 +33,76 @@ class SlotMap {
   T *get(const ID &id) const;
   void destroy(ID id);
 
+  // Fills ids with newly created objects, growing the table at most once
+  void create(gsl::span<ID> ids);
+  void destroy(gsl::span<const ID> ids);
+
+  // Invalidates ids like destroy() but keeps their slots out of the free list
+  // until they are handed to release()
+  void retire(ID id);
+  void retire(gsl::span<const ID> ids);
+  void release(gsl::span<const ID> ids);
+
+  // Ids of all live objects, packed together in no particular order
+  gsl::span<const ID> ids() const {
+    return {dense_.data(), static_cast<std::ptrdiff_t>(dense_.size())};
+  }
+  size_t size() const { return dense_.size(); }
+
+  // Calls f(T &) for every live object. Walks back to front, so f may destroy
+  // the object it was given.
+  template<typename F>
+  void for_each(F &&f) const;
+
  private:
-  typedef std::unique_ptr<T[]> Chunk;
+  typedef Pointer<T[]> Chunk;
+
+  void add_chunks(size_t count);
 
+  T *slot(typename ID::type index) const {
+    return &slot_table_[index / kChunkSize][index % kChunkSize];
+  }
+
+  foundation::Allocator *allocator_;
   Vector<Chunk> slot_table_;
   Vector<typename ID::type> free_list_;
+
+  // Sparse set over the slots, dense_index_ holds each live slot's position
+  // in dense_
+  Vector<ID> dense_;
+  Vector<typename ID::type> dense_index_;
 };
 
+template<typename T, typename ID>
+void SlotMap<T, ID>::add_chunks(size_t count) {
+  auto slot_table_size = slot_table_.size();
+  auto slot_count = kChunkSize * (slot_table_size + count);
+  free_list_.reserve(slot_count);
+  dense_index_.resize(slot_count);
+
+  // Mark the new chunks as free, lowest index on top
+  typename ID::type first_index = slot_table_size * kChunkSize;
+  for (auto i = slot_count; i > first_index; --i) {
+    free_list_.push_back(i - 1);
+  }
+
+  // Add new chunks to table
+  for (auto i = 0_z; i < count; ++i) {
+    slot_table_.push_back(allocate_unique<T[]>(*allocator_, kChunkSize));
+  }
+
+  // Reserve ID 0.0 (index.version) as 'null' ID
+  if (slot_table_size == 0) {
+    T &first_object = slot_table_[0][0];
+    first_object.id.version = 1;
+  }
+}
+
 template<typename T, typename ID>
 ID SlotMap<T, ID>::create() {
   // Are there no spare entities?
   if (free_list_.empty()) {
-    auto slot_table_size = slot_table_.size();
-    free_list_.reserve(kChunkSize * (slot_table_size + 1));
-
-    // Mark entire chunk as free
-    typename ID::type last_index = slot_table_size * kChunkSize;
-    for (int i = kChunkSize - 1; i >= 0; --i) {
-      free_list_.push_back(last_index + i);
-    }
-
-    // Add new chunk to table
-    slot_table_.emplace_back(new T[kChunkSize]);
-
-    // Reserve ID 0.0 (index.version) as 'null' ID
-    if (slot_table_.size() == 1) {
-      T &first_object = slot_table_[0][0];
-      first_object.id.version = 1;
-    }
+    add_chunks(1);
   }
 
   // get first free index
@@ -63,19 +110,47 @@ ID SlotMap<T, ID>::create() {
   free_list_.pop_back();
 
   // get object at index and update it's index
-  T *object = &slot_table_[free_index / kChunkSize][free_index % kChunkSize];
+  T *object = slot(free_index);
   object->id.index = free_index;
 
+  dense_index_[free_index] = dense_.size();
+  dense_.push_back(object->id);
+
   return object->id;
 }
 
+template<typename T, typename ID>
+void SlotMap<T, ID>::create(gsl::span<ID> ids) {
+  auto count = static_cast<size_t>(ids.size());
+  if (free_list_.size() < count) {
+    add_chunks((count - free_list_.size() + kChunkSize - 1) / kChunkSize);
+  }
+
+  // Take the top of the free list in one go
+  auto *free_indices = free_list_.data() + free_list_.size();
+  auto dense_size = dense_.size();
+  dense_.resize(dense_size + count);
+
+  for (auto i = 0_z; i < count; ++i) {
+    auto free_index = *--free_indices;
+    T *object = slot(free_index);
+    object->id.index = free_index;
+
+    dense_index_[free_index] = dense_size + i;
+    dense_[dense_size + i] = object->id;
+    ids[i] = object->id;
+  }
+
+  free_list_.resize(free_list_.size() - count);
+}
+
 template<typename T, typename ID>
 T *SlotMap<T, ID>::get(const ID &id) const {
   typename ID::type chunkIndex = id.index / kChunkSize;
 
   // Does the chunk exist?
   if (chunkIndex < slot_table_.size()) {
-    T *object = &slot_table_[chunkIndex][id.index % kChunkSize];
+    T *object = slot(id.index);
 
     // If the ids (specifically the versions) match return object else NULL
     return object->id == id ? object : nullptr;
@@ -88,6 +163,20 @@ T *SlotMap<T, ID>::get(const ID &id) const {
 
 template<typename T, typename ID>
 void SlotMap<T, ID>::destroy(ID id) {
+  retire(id);
+  free_list_.push_back(id.index);
+}
+
+template<typename T, typename ID>
+void SlotMap<T, ID>::destroy(gsl::span<const ID> ids) {
+  // Back to front, so ids may be a range of ids() itself
+  for (auto i = ids.size(); i > 0; --i) {
+    destroy(ids[i - 1]);
+  }
+}
+
+template<typename T, typename ID>
+void SlotMap<T, ID>::retire(ID id) {
   T *object = get(id);
 
   XASSERT(object != nullptr, "Trying to delete non-existent object: %lu", id.id);
@@ -95,7 +184,35 @@ void SlotMap<T, ID>::destroy(ID id) {
   // Increment version to generate unique id and invalidate old id
   object->id.version++;
 
-  free_list_.push_back(object->id.index);
+  // Move the last live id into the hole
+  auto position = dense_index_[id.index];
+  const ID &last = dense_.back();
+  dense_index_[last.index] = position;
+  dense_[position] = last;
+  dense_.pop_back();
+}
+
+template<typename T, typename ID>
+void SlotMap<T, ID>::retire(gsl::span<const ID> ids) {
+  for (auto i = ids.size(); i > 0; --i) {
+    retire(ids[i - 1]);
+  }
+}
+
+template<typename T, typename ID>
+void SlotMap<T, ID>::release(gsl::span<const ID> ids) {
+  for (auto &&id : ids) {
+    XASSERT(get(id) == nullptr, "Trying to release a live object: %lu", id.id);
+    free_list_.push_back(id.index);
+  }
+}
+
+template<typename T, typename ID>
+template<typename F>
+void SlotMap<T, ID>::for_each(F &&f) const {
+  for (auto i = dense_.size(); i > 0u; --i) {
+    f(*slot(dense_[i - 1u].index));
+  }
 }
 
 } // namespace knight
@@ -0,0 +1,109 @@
+#pragma once
+
+#include "common.h"
+#include "types.h"
+#include "vector.h"
+
+#include <memory.h>
+
+#include <cstddef>
+#include <new>
+
+namespace knight {
+
+// Values keyed by id and stored at the id's index, in pages that are only
+// allocated once an index in them is used. A lookup is two array reads, the
+// id kept next to the value tells a live key from an older version of it.
+template<typename T, typename ID = Entity::ID>
+class SparseArray {
+ public:
+  static const size_t kPageSize = 4096;
+
+  SparseArray(foundation::Allocator &allocator)
+    : allocator_{allocator},
+      pages_{allocator} { }
+  ~SparseArray();
+
+  bool has(ID id) const { return find(id) != nullptr; }
+
+  // Returns the value stored for id, or deflt if there is none
+  const T &get(ID id, const T &deflt) const;
+
+  void set(ID id, const T &value);
+  void remove(ID id);
+
+ private:
+  struct Entry {
+    typename ID::type id;
+    T value;
+  };
+
+  Entry *find(ID id) const;
+
+  foundation::Allocator &allocator_;
+  Vector<Entry *> pages_;
+
+  KNIGHT_DISALLOW_COPY_AND_ASSIGN(SparseArray);
+};
+
+template<typename T, typename ID>
+SparseArray<T, ID>::~SparseArray() {
+  for (auto *page : pages_) {
+    if (page != nullptr) {
+      for (auto i = 0_z; i < kPageSize; ++i) {
+        page[i].~Entry();
+      }
+      allocator_.deallocate(page);
+    }
+  }
+}
+
+template<typename T, typename ID>
+auto SparseArray<T, ID>::find(ID id) const -> Entry * {
+  auto page_index = id.index / kPageSize;
+  if (page_index >= pages_.size() || pages_[page_index] == nullptr) {
+    return nullptr;
+  }
+
+  auto *entry = &pages_[page_index][id.index % kPageSize];
+  return entry->id == id.id ? entry : nullptr;
+}
+
+template<typename T, typename ID>
+const T &SparseArray<T, ID>::get(ID id, const T &deflt) const {
+  auto *entry = find(id);
+  return entry != nullptr ? entry->value : deflt;
+}
+
+template<typename T, typename ID>
+void SparseArray<T, ID>::set(ID id, const T &value) {
+  // Empty entries hold the reserved null id
+  XASSERT(id.id != 0, "Cannot store a value for the null id");
+
+  auto page_index = id.index / kPageSize;
+  if (page_index >= pages_.size()) {
+    pages_.resize(page_index + 1, nullptr);
+  }
+
+  auto *&page = pages_[page_index];
+  if (page == nullptr) {
+    page = static_cast<Entry *>(allocator_.allocate(sizeof(Entry) * kPageSize, alignof(Entry)));
+    for (auto i = 0_z; i < kPageSize; ++i) {
+      new (page + i) Entry{};
+    }
+  }
+
+  auto &entry = page[id.index % kPageSize];
+  entry.id = id.id;
+  entry.value = value;
+}
+
+template<typename T, typename ID>
+void SparseArray<T, ID>::remove(ID id) {
+  auto *entry = find(id);
+  if (entry != nullptr) {
+    *entry = Entry{};
+  }
+}
+
+} // namespace knight
@@ -0,0 +1,150 @@
+#pragma once
+
+#include "common.h"
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace knight {
+
+// Fixed size ring between exactly one producer and one consumer thread, such
+// as simulation and render. Every operation finishes in a bounded number of
+// steps. Each side keeps a copy of the other side's index and only reloads it
+// when the ring looks full or empty, so in the common case the two threads
+// only touch each other's cache line to hand items over.
+template<typename T>
+class SpscChannel {
+ public:
+  // Rounded up to a power of two
+  explicit SpscChannel(size_t capacity = 1024);
+  ~SpscChannel();
+
+  // Producer side, constructs the item in place. Returns false when full.
+  template<typename... Args>
+  bool try_emplace(Args&&... args);
+
+  bool try_push(const T &item) { return try_emplace(item); }
+  bool try_push(T &&item) { return try_emplace(std::move(item)); }
+
+  // Consumer side. front() returns the oldest item in place or nullptr,
+  // pop() destroys it.
+  T *front();
+  void pop();
+
+  bool try_pop(T &item);
+
+  // Exact only when called from one of the two threads while the other one
+  // is idle
+  size_t size() const;
+  bool empty() const { return size() == 0u; }
+  size_t capacity() const { return mask_ + 1u; }
+
+ private:
+  using Storage = std::aligned_storage_t<sizeof(T), alignof(T)>;
+
+  T *slot(size_t index) {
+    return reinterpret_cast<T *>(&slots_[index & mask_]);
+  }
+
+  std::unique_ptr<Storage[]> slots_;
+  size_t mask_;
+
+  char padding0_[CACHE_LINE_SIZE];
+
+  // Written by the producer
+  std::atomic<size_t> tail_;
+  size_t cached_head_;
+  char padding1_[CACHE_LINE_SIZE];
+
+  // Written by the consumer
+  std::atomic<size_t> head_;
+  size_t cached_tail_;
+  char padding2_[CACHE_LINE_SIZE];
+
+  KNIGHT_DISALLOW_COPY_AND_ASSIGN(SpscChannel);
+};
+
+// Template implementations
+
+template<typename T>
+SpscChannel<T>::SpscChannel(size_t capacity)
+  : tail_{0u},
+    cached_head_{0u},
+    head_{0u},
+    cached_tail_{0u} {
+  auto rounded = size_t{2u};
+  while (rounded < capacity) {
+    rounded *= 2u;
+  }
+
+  slots_.reset(new Storage[rounded]);
+  mask_ = rounded - 1u;
+}
+
+template<typename T>
+SpscChannel<T>::~SpscChannel() {
+  while (front() != nullptr) {
+    pop();
+  }
+}
+
+template<typename T>
+template<typename... Args>
+bool SpscChannel<T>::try_emplace(Args&&... args) {
+  auto tail = tail_.load(std::memory_order_relaxed);
+  if (tail - cached_head_ == capacity()) {
+    cached_head_ = head_.load(std::memory_order_acquire);
+    if (tail - cached_head_ == capacity()) {
+      return false;
+    }
+  }
+
+  new (slot(tail)) T(std::forward<Args>(args)...);
+  tail_.store(tail + 1u, std::memory_order_release);
+  return true;
+}
+
+template<typename T>
+T *SpscChannel<T>::front() {
+  auto head = head_.load(std::memory_order_relaxed);
+  if (head == cached_tail_) {
+    cached_tail_ = tail_.load(std::memory_order_acquire);
+    if (head == cached_tail_) {
+      return nullptr;
+    }
+  }
+
+  return slot(head);
+}
+
+template<typename T>
+void SpscChannel<T>::pop() {
+  auto head = head_.load(std::memory_order_relaxed);
+  slot(head)->~T();
+  head_.store(head + 1u, std::memory_order_release);
+}
+
+template<typename T>
+bool SpscChannel<T>::try_pop(T &item) {
+  auto *oldest = front();
+  if (oldest == nullptr) {
+    return false;
+  }
+
+  item = std::move(*oldest);
+  pop();
+  return true;
+}
+
+template<typename T>
+size_t SpscChannel<T>::size() const {
+  auto head = head_.load(std::memory_order_acquire);
+  auto tail = tail_.load(std::memory_order_acquire);
+  return tail - head;
+}
+
+} // namespace knight
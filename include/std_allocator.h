@@ -53,23 +53,24 @@ struct StdDeleter {
 
   StdDeleter(foundation::Allocator &allocator, uint32_t array_size) :
     allocator{&allocator},
-    array_size_{array_size} {}
+    array_size_{array_size},
+    is_array_{true} {}
 
+  // std::unique_ptr<T[]> hands over a plain T *, so whether p points to an
+  // array is only known from how the deleter was made
   template<typename T>
-  std::enable_if_t<!std::is_array<T>::value> operator()(T *p) const {
+  void operator()(T *p) const {
     XASSERT(allocator != nullptr, "Cannot delete pointer without foundation allocator");
-    allocator->make_delete(p);
+    if (is_array_) {
+      allocator->make_array_delete(p, array_size_);
+    } else {
+      allocator->make_delete(p);
+    }
   }
 
-  template<typename T>
-  std::enable_if_t<std::is_array<T>::value>
-    operator()(T *p) const {
-    XASSERT(allocator != nullptr, "Cannot delete pointer without foundation allocator");
-    allocator->make_array_delete(p, array_size_);
-  }
-
-  foundation::Allocator *allocator;
-  uint32_t array_size_;
+  foundation::Allocator *allocator = nullptr;
+  uint32_t array_size_ = 0u;
+  bool is_array_ = false;
 };
 
 template<typename T, typename U>
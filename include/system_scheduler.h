@@ -0,0 +1,84 @@
+#pragma once
+
+#include "job_system.h"
+#include "type_map.h"
+#include "vector.h"
+
+#include <memory_types.h>
+
+#include <functional>
+
+namespace knight {
+
+// Runs a set of systems once per frame as a graph of jobs. Systems declare
+// which component types they read and write. Two systems touching the same
+// type, with at least one of them writing it, run in the order they were
+// added; everything else is free to run in parallel.
+class SystemScheduler {
+ public:
+  using Function = std::function<void()>;
+
+  class System {
+   public:
+    System(foundation::Allocator &allocator, const char *name, Function function);
+
+    template<typename T>
+    System &reads() {
+      reads_.push_back(TypeMap<uint32_t>::type_id<T>());
+      return *this;
+    }
+
+    template<typename T>
+    System &writes() {
+      writes_.push_back(TypeMap<uint32_t>::type_id<T>());
+      return *this;
+    }
+
+    // For systems making GL calls, they run on the thread calling run()
+    System &on_main_thread() {
+      main_thread_ = true;
+      return *this;
+    }
+
+    const char *name() const { return name_; }
+
+   private:
+    friend class SystemScheduler;
+
+    bool conflicts_with(const System &other) const;
+
+    const char *name_;
+    Function function_;
+    Vector<int> reads_;
+    Vector<int> writes_;
+    bool main_thread_;
+
+    // Earlier systems this one has to wait for
+    Vector<uint32_t> dependencies_;
+  };
+
+  explicit SystemScheduler(foundation::Allocator &allocator);
+
+  // The returned system stays valid until the next call to add
+  System &add(const char *name, Function function);
+
+  // Runs every system and returns once all of them have finished. Must be
+  // called from the main thread if any system runs on it.
+  void run();
+
+  uint32_t size() const { return gsl::narrow_cast<uint32_t>(systems_.size()); }
+
+ private:
+  static void run_system(Job *job, const void *data);
+
+  void build();
+
+  foundation::Allocator &allocator_;
+  Vector<System> systems_;
+  Vector<Job *> jobs_;
+  bool dirty_;
+
+  KNIGHT_DISALLOW_COPY_AND_ASSIGN(SystemScheduler);
+};
+
+} // namespace knight
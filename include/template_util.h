@@ -2,6 +2,8 @@
 
 #include "common.h"
 
+#include <type_traits>
+
 namespace knight {
 
 namespace templ {
@@ -43,4 +45,11 @@ constexpr std::size_t sizeof_sum(const T &value, const Args&... args) {
   return sizeof(T) + sizeof_sum(args...);
 }
 
+template<typename ...Args>
+struct all_trivially_copyable : std::true_type { };
+
+template<typename T, typename ...Args>
+struct all_trivially_copyable<T, Args...>
+  : std::integral_constant<bool, std::is_trivially_copyable<T>::value && all_trivially_copyable<Args...>::value> { };
+
 } // namespace knight
@@ -1,38 +1,331 @@
 #pragma once
 
 #include "common.h"
+#include "concurrent_queue.h"
+#include "event_count.h"
 
-#include <functional>
-#include <thread>
-#include <mutex>
-#include <condition_variable>
+#include <algorithm>
 #include <atomic>
+#include <cstddef>
 #include <memory>
-#include <queue>
+#include <new>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 namespace knight {
 
+// A type erased void() callable. Callables of up to kInlineSize bytes are
+// stored in place, larger ones go to the heap.
+class Task {
+ public:
+  static const std::size_t kInlineSize = 48;
+
+  Task() : invoke_{nullptr}, manage_{nullptr} { }
+
+  template<typename F, typename = std::enable_if_t<!std::is_same<std::decay_t<F>, Task>::value>>
+  explicit Task(F &&function);
+
+  Task(Task &&other) : invoke_{nullptr}, manage_{nullptr} {
+    *this = std::move(other);
+  }
+
+  Task &operator=(Task &&other);
+
+  ~Task() { reset(); }
+
+  void operator()() { invoke_(&storage_); }
+
+  explicit operator bool() const { return invoke_ != nullptr; }
+
+ private:
+  using Storage = std::aligned_storage_t<kInlineSize, alignof(std::max_align_t)>;
+
+  template<typename F>
+  using stored_inline = std::integral_constant<bool,
+    sizeof(F) <= kInlineSize &&
+    alignof(F) <= alignof(Storage) &&
+    std::is_nothrow_move_constructible<F>::value>;
+
+  template<typename F>
+  static void invoke_inline(void *storage) { (*static_cast<F *>(storage))(); }
+
+  template<typename F>
+  static void invoke_heap(void *storage) { (**static_cast<F **>(storage))(); }
+
+  // Moves the callable from one storage into another, or destroys it when
+  // there is nowhere to move it to
+  template<typename F>
+  static void manage_inline(void *from, void *to) {
+    auto *function = static_cast<F *>(from);
+    if (to != nullptr) {
+      new (to) F{std::move(*function)};
+    }
+    function->~F();
+  }
+
+  template<typename F>
+  static void manage_heap(void *from, void *to) {
+    auto *function = *static_cast<F **>(from);
+    if (to != nullptr) {
+      *static_cast<F **>(to) = function;
+    } else {
+      delete function;
+    }
+  }
+
+  template<typename F>
+  void store(F &&function, std::true_type) {
+    using Function = std::decay_t<F>;
+    new (&storage_) Function{std::forward<F>(function)};
+    invoke_ = &invoke_inline<Function>;
+    manage_ = &manage_inline<Function>;
+  }
+
+  template<typename F>
+  void store(F &&function, std::false_type) {
+    using Function = std::decay_t<F>;
+    *reinterpret_cast<Function **>(&storage_) = new Function{std::forward<F>(function)};
+    invoke_ = &invoke_heap<Function>;
+    manage_ = &manage_heap<Function>;
+  }
+
+  void reset() {
+    if (manage_ != nullptr) {
+      manage_(&storage_, nullptr);
+      invoke_ = nullptr;
+      manage_ = nullptr;
+    }
+  }
+
+  void (*invoke_)(void *);
+  void (*manage_)(void *, void *);
+  Storage storage_;
+
+  KNIGHT_DISALLOW_COPY_AND_ASSIGN(Task);
+};
+
+template<typename T>
+class TaskFuture;
+
+class ThreadPool;
+
+namespace detail {
+  enum FutureStatus : uint32_t {
+    kPending,
+    kReady,
+
+    // The task was destroyed without running, the pool went away first
+    kAbandoned
+  };
+
+  // Shared between a future and the task fulfilling it, whichever lets go
+  // last frees it
+  template<typename T>
+  struct FutureState {
+    std::atomic<uint32_t> ready{kPending};
+    std::atomic<uint32_t> references{2u};
+    std::aligned_storage_t<sizeof(T), alignof(T)> value;
+
+    template<typename F>
+    void fulfill(F &function) {
+      new (&value) T(function());
+    }
+
+    T take() {
+      return std::move(*reinterpret_cast<T *>(&value));
+    }
+
+    ~FutureState() {
+      if (ready.load(std::memory_order_relaxed) == kReady) {
+        reinterpret_cast<T *>(&value)->~T();
+      }
+    }
+  };
+
+  template<>
+  struct FutureState<void> {
+    std::atomic<uint32_t> ready{kPending};
+    std::atomic<uint32_t> references{2u};
+
+    template<typename F>
+    void fulfill(F &function) {
+      function();
+    }
+
+    void take() { }
+  };
+
+  template<typename T>
+  void release(FutureState<T> *state) {
+    if (state->references.fetch_sub(1u, std::memory_order_acq_rel) == 1u) {
+      delete state;
+    }
+  }
+
+  template<typename T>
+  void settle(FutureState<T> *state, FutureStatus status) {
+    state->ready.store(status, std::memory_order_release);
+    release(state);
+  }
+
+  // The task side of a future. Fulfills the state when run, and abandons it
+  // when the task is destroyed without running, so neither side leaks it.
+  template<typename T, typename F>
+  class Promise {
+   public:
+    template<typename G>
+    Promise(FutureState<T> *state, G &&function)
+      : state_{state}, function_{std::forward<G>(function)} { }
+
+    Promise(Promise &&other) noexcept(std::is_nothrow_move_constructible<F>::value)
+      : state_{other.state_}, function_{std::move(other.function_)} {
+      other.state_ = nullptr;
+    }
+
+    ~Promise() {
+      if (state_ != nullptr) {
+        settle(state_, kAbandoned);
+      }
+    }
+
+    void operator()() {
+      state_->fulfill(function_);
+      settle(state_, kReady);
+      state_ = nullptr;
+    }
+
+   private:
+    FutureState<T> *state_;
+    F function_;
+
+    KNIGHT_DISALLOW_COPY_AND_ASSIGN(Promise);
+  };
+
+  template<typename F, typename Tuple, std::size_t... I>
+  decltype(auto) apply(F &function, Tuple &arguments, std::index_sequence<I...>) {
+    return function(std::get<I>(arguments)...);
+  }
+
+  // Arguments are stored with the function and handed to it as lvalues, the
+  // way std::bind does
+  template<typename F, typename... Args>
+  auto bind_arguments(F &&function, Args&&... args) {
+    return [function = std::forward<F>(function), arguments = std::make_tuple(std::forward<Args>(args)...)]() mutable -> decltype(auto) {
+      return apply(function, arguments, std::index_sequence_for<Args...>{});
+    };
+  }
+
+  template<typename F>
+  decltype(auto) bind_arguments(F &&function) {
+    return std::forward<F>(function);
+  }
+} // namespace detail
+
+// Handed out by ThreadPool::Submit, get() runs queued tasks on the calling
+// thread until the task ran. A pool that is shutting down hands out invalid
+// futures.
+template<typename T>
+class TaskFuture {
+ public:
+  TaskFuture() : state_{nullptr}, pool_{nullptr} { }
+  TaskFuture(detail::FutureState<T> *state, ThreadPool &pool) : state_{state}, pool_{&pool} { }
+
+  TaskFuture(TaskFuture &&other) : state_{other.state_}, pool_{other.pool_} {
+    other.state_ = nullptr;
+  }
+
+  TaskFuture &operator=(TaskFuture &&other) {
+    std::swap(state_, other.state_);
+    std::swap(pool_, other.pool_);
+    return *this;
+  }
+
+  ~TaskFuture() {
+    if (state_ != nullptr) {
+      detail::release(state_);
+    }
+  }
+
+  bool valid() const { return state_ != nullptr; }
+
+  bool ready() const {
+    XASSERT(valid(), "Future has no task");
+    return state_->ready.load(std::memory_order_acquire) == detail::kReady;
+  }
+
+  // Also returns if the pool was destroyed before the task could run
+  void wait() const;
+
+  // Only once per future
+  T get() {
+    wait();
+    XASSERT(ready(), "Task was dropped before it ran");
+    return state_->take();
+  }
+
+ private:
+  bool settled() const {
+    return state_->ready.load(std::memory_order_acquire) != detail::kPending;
+  }
+
+  detail::FutureState<T> *state_;
+  ThreadPool *pool_;
+
+  KNIGHT_DISALLOW_COPY_AND_ASSIGN(TaskFuture);
+};
+
 class ThreadPool {
  public:
+  static const std::size_t kDefaultQueueCapacity = 8192;
+
   ThreadPool() : ThreadPool(std::thread::hardware_concurrency()) { }
-  explicit ThreadPool(const unsigned int &thread_count);
+
+  // The queue holds queue_capacity tasks, rounded up to a power of two.
+  // Enqueueing into a full queue runs queued tasks on the calling thread
+  // until there is room.
+  explicit ThreadPool(const unsigned int &thread_count, std::size_t queue_capacity = kDefaultQueueCapacity);
 
   ~ThreadPool();
 
+  // Returns false, dropping the task, once the pool is shutting down
   template<typename F, typename... Args>
-  void Enqueue(F&& f, Args&&... args);
+  bool Enqueue(F&& f, Args&&... args);
 
-  void Sync() const;
+  // Same as Enqueue, the future holds whatever f returns
+  template<typename F, typename... Args>
+  auto Submit(F&& f, Args&&... args) -> TaskFuture<decltype(detail::bind_arguments(std::forward<F>(f), std::forward<Args>(args)...)())>;
+
+  // Enqueues f(i) for every i in [begin, end), waking the workers once. f is
+  // copied into every task, keep it small. Enqueues all of them or, once the
+  // pool is shutting down, none.
+  template<typename F>
+  bool EnqueueRange(std::size_t begin, std::size_t end, F&& f);
+
+  // Waits for every task, including those of task groups, running queued
+  // tasks on the calling thread in the meantime
+  void Sync();
 
  private:
-  typedef std::function<void()> Task;
+  friend class TaskGroup;
+
+  template<typename T>
+  friend class TaskFuture;
+
+  void Push(Task &task);
+  bool RunOne();
+  void WorkerMain();
+
+  template<typename Done>
+  void HelpUntil(EventCount &event, Done &&done);
 
-  std::queue<Task> queue_;
+  BoundedConcurrentQueue<Task> queue_;
   std::vector<std::thread> thread_pool_;
 
-  mutable std::condition_variable queue_condition_;
-  mutable std::condition_variable sync_condition_;
-  mutable std::mutex mutex_;
+  EventCount task_available_;
+  EventCount tasks_finished_;
 
   std::atomic_bool stop_;
   std::atomic_uint unfinished_task_count_;
@@ -41,68 +334,268 @@ class ThreadPool {
   KNIGHT_DISALLOW_MOVE_AND_ASSIGN(ThreadPool);
 };
 
-ThreadPool::ThreadPool(const unsigned int &thread_count)
-  : stop_(false), unfinished_task_count_(0) {
+// Tasks sharing a pool with other groups that can be waited for on their
+// own, so independent pipelines do not wait on each other's work
+class TaskGroup {
+ public:
+  explicit TaskGroup(ThreadPool &pool) : pool_(pool), unfinished_task_count_(0) { }
+
+  ~TaskGroup() { Wait(); }
+
+  // Same as the pool's, false when the pool turned the tasks down
+  template<typename F, typename... Args>
+  bool Enqueue(F&& f, Args&&... args);
+
+  template<typename F>
+  bool EnqueueRange(std::size_t begin, std::size_t end, F&& f);
+
+  // Returns once every task of the group ran, running queued tasks of any
+  // group on the calling thread in the meantime
+  void Wait();
+
+  bool Done() const { return unfinished_task_count_ == 0; }
+
+ private:
+  void Finish();
+
+  ThreadPool &pool_;
+  std::atomic_uint unfinished_task_count_;
+
+  KNIGHT_DISALLOW_COPY_AND_ASSIGN(TaskGroup);
+  KNIGHT_DISALLOW_MOVE_AND_ASSIGN(TaskGroup);
+};
+
+// Template implementations
+
+template<typename F, typename>
+Task::Task(F &&function) : invoke_{nullptr}, manage_{nullptr} {
+  store(std::forward<F>(function), stored_inline<std::decay_t<F>>{});
+}
+
+inline Task &Task::operator=(Task &&other) {
+  if (this != &other) {
+    reset();
+    if (other.manage_ != nullptr) {
+      other.manage_(&other.storage_, &storage_);
+      invoke_ = other.invoke_;
+      manage_ = other.manage_;
+      other.invoke_ = nullptr;
+      other.manage_ = nullptr;
+    }
+  }
+  return *this;
+}
+
+inline ThreadPool::ThreadPool(const unsigned int &thread_count, std::size_t queue_capacity)
+  : queue_{queue_capacity}, stop_(false), unfinished_task_count_(0) {
   for (unsigned int i = 0; i < thread_count; ++i) {
-    thread_pool_.emplace_back([this] {
-      Task task;
-      while (true) {
-        {
-          std::unique_lock<std::mutex> lock(mutex_);
-          queue_condition_.wait(lock, [this] {
-            return !queue_.empty() || stop_; 
-          });
-
-          if (stop_) {
-            return;
-          }
-
-          task = queue_.front();
-          queue_.pop();
-        }
-
-        task();
-
-        if (--unfinished_task_count_ == 0) {
-          sync_condition_.notify_one();
-        }
-      }
-    });
+    thread_pool_.emplace_back([this] { WorkerMain(); });
   }
 }
 
-ThreadPool::~ThreadPool() {
+inline ThreadPool::~ThreadPool() {
   stop_ = true;
 
-  queue_condition_.notify_all();
+  task_available_.notify_all();
 
   for (size_t i = 0; i < thread_pool_.size(); ++i) {
     thread_pool_[i].join();
   }
+
+  tasks_finished_.notify_all();
+}
+
+inline void ThreadPool::WorkerMain() {
+  while (true) {
+    if (RunOne()) {
+      continue;
+    }
+
+    auto key = task_available_.prepare_wait();
+    if (stop_) {
+      task_available_.cancel_wait();
+      return;
+    }
+
+    if (RunOne()) {
+      task_available_.cancel_wait();
+      continue;
+    }
+
+    task_available_.wait(key);
+  }
+}
+
+inline bool ThreadPool::RunOne() {
+  Task task;
+  if (!queue_.try_pop(task)) {
+    return false;
+  }
+
+  task();
+
+  if (--unfinished_task_count_ == 0) {
+    tasks_finished_.notify_all();
+  }
+  return true;
+}
+
+inline void ThreadPool::Push(Task &task) {
+  while (!queue_.try_push(std::move(task))) {
+    task_available_.notify_all();
+    if (!RunOne()) {
+      std::this_thread::yield();
+    }
+  }
 }
 
 template<typename F, typename... Args>
-void ThreadPool::Enqueue(F&& task_function, Args&&... args) {
+bool ThreadPool::Enqueue(F&& task_function, Args&&... args) {
   if (stop_) {
-    return;
+    return false;
+  }
+
+  unfinished_task_count_++;
+
+  Task task{detail::bind_arguments(std::forward<F>(task_function), std::forward<Args>(args)...)};
+  Push(task);
+
+  task_available_.notify();
+  return true;
+}
+
+template<typename F, typename... Args>
+auto ThreadPool::Submit(F&& task_function, Args&&... args) -> TaskFuture<decltype(detail::bind_arguments(std::forward<F>(task_function), std::forward<Args>(args)...)())> {
+  using Function = decltype(detail::bind_arguments(std::forward<F>(task_function), std::forward<Args>(args)...));
+  using Result = decltype(std::declval<Function &>()());
+
+  if (stop_) {
+    return {};
   }
 
+  auto *state = new detail::FutureState<Result>{};
+  auto promise = detail::Promise<Result, std::decay_t<Function>>{
+    state, detail::bind_arguments(std::forward<F>(task_function), std::forward<Args>(args)...)};
+
   unfinished_task_count_++;
 
-  {
-    std::lock_guard<std::mutex> lock(mutex_);
-    queue_.push(std::bind(std::forward<F>(task_function), std::forward<Args>(args)...));
+  // Wakes futures helping in HelpUntil, they sleep on tasks_finished_
+  Task task{[this, promise = std::move(promise)]() mutable {
+    promise();
+    tasks_finished_.notify_all();
+  }};
+  Push(task);
+
+  task_available_.notify();
+  return TaskFuture<Result>{state, *this};
+}
+
+template<typename F>
+bool ThreadPool::EnqueueRange(std::size_t begin, std::size_t end, F&& task_function) {
+  if (stop_) {
+    return false;
+  }
+  if (begin >= end) {
+    return true;
+  }
+
+  unfinished_task_count_ += static_cast<unsigned int>(end - begin);
+
+  for (auto i = begin; i < end; ++i) {
+    Task task{[task_function, i]() mutable { task_function(i); }};
+    Push(task);
+  }
+
+  task_available_.notify(static_cast<uint32_t>(std::min<std::size_t>(end - begin, thread_pool_.size())));
+  return true;
+}
+
+template<typename Done>
+void ThreadPool::HelpUntil(EventCount &event, Done &&done) {
+  while (!done()) {
+    if (RunOne()) {
+      continue;
+    }
+
+    auto key = event.prepare_wait();
+    if (done()) {
+      event.cancel_wait();
+      return;
+    }
+
+    if (RunOne()) {
+      event.cancel_wait();
+      continue;
+    }
+
+    event.wait(key);
+  }
+}
+
+template<typename T>
+void TaskFuture<T>::wait() const {
+  XASSERT(valid(), "Future has no task");
+  if (settled()) {
+    return;
   }
 
-  queue_condition_.notify_one();
+  pool_->HelpUntil(pool_->tasks_finished_, [this] { return settled(); });
+}
+
+inline void ThreadPool::Sync() {
+  HelpUntil(tasks_finished_, [this] {
+    return unfinished_task_count_ == 0 || stop_;
+  });
+}
+
+// Tasks are counted before they are handed to the pool, they may finish
+// before Enqueue returns. Whatever the pool turns down is taken back out.
+template<typename F, typename... Args>
+bool TaskGroup::Enqueue(F&& task_function, Args&&... args) {
+  unfinished_task_count_++;
+
+  auto accepted = pool_.Enqueue([this, function = detail::bind_arguments(std::forward<F>(task_function), std::forward<Args>(args)...)]() mutable {
+    function();
+    Finish();
+  });
+
+  if (!accepted) {
+    Finish();
+  }
+  return accepted;
 }
 
-void ThreadPool::Sync() const {
-  std::unique_lock<std::mutex> lock(mutex_);
+template<typename F>
+bool TaskGroup::EnqueueRange(std::size_t begin, std::size_t end, F&& task_function) {
+  if (begin >= end) {
+    return true;
+  }
+
+  auto count = static_cast<unsigned int>(end - begin);
+  unfinished_task_count_ += count;
 
-  sync_condition_.wait(lock, [this] {
-    return unfinished_task_count_ == 0 || stop_; 
+  auto accepted = pool_.EnqueueRange(begin, end, [this, task_function](std::size_t i) mutable {
+    task_function(i);
+    Finish();
   });
+
+  if (!accepted && (unfinished_task_count_ -= count) == 0) {
+    pool_.tasks_finished_.notify_all();
+  }
+  return accepted;
+}
+
+// Waiters sleep on the pool's event rather than one of the group's, the group
+// may be gone as soon as the count reaches zero
+inline void TaskGroup::Finish() {
+  auto &pool = pool_;
+  if (--unfinished_task_count_ == 0) {
+    pool.tasks_finished_.notify_all();
+  }
+}
+
+inline void TaskGroup::Wait() {
+  pool_.HelpUntil(pool_.tasks_finished_, [this] { return Done(); });
 }
 
 } // namespace knight;
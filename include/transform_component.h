@@ -41,8 +41,6 @@ class TransformComponent : public Component<TransformComponent> {
   void allocate(uint32_t size);
   void destroy(uint32_t i);
 
-  void collect_garbage(const EntityManager &em);
-
   bool is_valid(Instance instance) const;
   
   void swap(Instance instanceA, Instance instanceB);
@@ -0,0 +1,176 @@
+#pragma once
+
+#include "common.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+namespace knight {
+
+// Chase-Lev deque with the memory orderings from Le et al., "Correct and
+// Efficient Work-Stealing for Weak Memory Models". The owner pushes and pops
+// at the bottom, any other thread steals from the top. Grows instead of
+// failing when full.
+//
+// T has to be a pointer, nullptr is returned when there is nothing to take or
+// a steal lost a race.
+template<typename T>
+class WorkStealingQueue {
+  static const int64_t kDefaultCapacity = 1024;
+
+ public:
+  explicit WorkStealingQueue(int64_t capacity = kDefaultCapacity);
+  ~WorkStealingQueue();
+
+  // Owner only
+  void push(T item);
+  T pop();
+
+  T steal();
+
+  // Only exact when called by the owner, thieves can use it as a hint
+  int64_t size() const;
+
+  int64_t capacity() const { return array_.load(std::memory_order_relaxed)->capacity; }
+
+ private:
+  struct Array {
+    explicit Array(int64_t capacity)
+      : capacity{capacity},
+        mask{capacity - 1},
+        items{new std::atomic<T>[capacity]} { }
+
+    ~Array() {
+      delete[] items;
+    }
+
+    T get(int64_t index) const {
+      return items[index & mask].load(std::memory_order_relaxed);
+    }
+
+    void put(int64_t index, T item) {
+      items[index & mask].store(item, std::memory_order_relaxed);
+    }
+
+    const int64_t capacity;
+    const int64_t mask;
+    std::atomic<T> *items;
+  };
+
+  Array *grow(Array *array, int64_t bottom, int64_t top);
+
+  std::atomic<int64_t> top_;
+  char padding_[CACHE_LINE_SIZE];
+  std::atomic<int64_t> bottom_;
+  std::atomic<Array *> array_;
+
+  // A thief may still be reading from an array we grew out of, so they are
+  // kept around until the queue goes away
+  std::vector<Array *> retired_;
+
+  KNIGHT_DISALLOW_COPY_AND_ASSIGN(WorkStealingQueue);
+};
+
+template<typename T>
+WorkStealingQueue<T>::WorkStealingQueue(int64_t capacity)
+    : top_{0},
+      bottom_{0},
+      array_{nullptr} {
+  XASSERT(capacity > 0 && (capacity & (capacity - 1)) == 0, "Capacity must be a power of two, got %lld", static_cast<long long>(capacity));
+  array_.store(new Array{capacity}, std::memory_order_relaxed);
+}
+
+template<typename T>
+WorkStealingQueue<T>::~WorkStealingQueue() {
+  delete array_.load(std::memory_order_relaxed);
+  for (auto &&array : retired_) {
+    delete array;
+  }
+}
+
+template<typename T>
+void WorkStealingQueue<T>::push(T item) {
+  auto bottom = bottom_.load(std::memory_order_relaxed);
+  auto top = top_.load(std::memory_order_acquire);
+  auto *array = array_.load(std::memory_order_relaxed);
+
+  if (bottom - top > array->capacity - 1) {
+    array = grow(array, bottom, top);
+  }
+
+  array->put(bottom, item);
+  std::atomic_thread_fence(std::memory_order_release);
+  bottom_.store(bottom + 1, std::memory_order_relaxed);
+}
+
+template<typename T>
+T WorkStealingQueue<T>::pop() {
+  auto bottom = bottom_.load(std::memory_order_relaxed) - 1;
+  auto *array = array_.load(std::memory_order_relaxed);
+  bottom_.store(bottom, std::memory_order_relaxed);
+
+  // Orders the store to bottom before the load of top, pairs with the fence in
+  // steal()
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  auto top = top_.load(std::memory_order_relaxed);
+
+  if (top > bottom) {
+    bottom_.store(bottom + 1, std::memory_order_relaxed);
+    return nullptr;
+  }
+
+  auto item = array->get(bottom);
+  if (top == bottom) {
+    // Last item, race the thieves for it
+    if (!top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+      item = nullptr;
+    }
+    bottom_.store(bottom + 1, std::memory_order_relaxed);
+  }
+
+  return item;
+}
+
+template<typename T>
+T WorkStealingQueue<T>::steal() {
+  auto top = top_.load(std::memory_order_acquire);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  auto bottom = bottom_.load(std::memory_order_acquire);
+
+  if (top >= bottom) {
+    return nullptr;
+  }
+
+  // Read the item before claiming it, once top moves on the owner may
+  // overwrite the slot
+  auto *array = array_.load(std::memory_order_acquire);
+  auto item = array->get(top);
+  if (!top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+    return nullptr;
+  }
+
+  return item;
+}
+
+template<typename T>
+int64_t WorkStealingQueue<T>::size() const {
+  auto bottom = bottom_.load(std::memory_order_relaxed);
+  auto top = top_.load(std::memory_order_relaxed);
+  return std::max<int64_t>(bottom - top, 0);
+}
+
+template<typename T>
+auto WorkStealingQueue<T>::grow(Array *array, int64_t bottom, int64_t top) -> Array * {
+  auto *bigger = new Array{array->capacity * 2};
+  for (auto i = top; i < bottom; ++i) {
+    bigger->put(i, array->get(i));
+  }
+
+  retired_.push_back(array);
+  array_.store(bigger, std::memory_order_release);
+  return bigger;
+}
+
+} // namespace knight
@@ -0,0 +1,449 @@
+#include "async_file.h"
+#include "common.h"
+#include "thread_pool.h"
+
+#if defined(__linux__) && defined(__has_include)
+  #if __has_include(<linux/io_uring.h>)
+    #define KNIGHT_HAS_IO_URING 1
+  #endif
+#endif
+
+#if !defined(KNIGHT_HAS_IO_URING)
+  #define KNIGHT_HAS_IO_URING 0
+#endif
+
+#if KNIGHT_HAS_IO_URING
+  #include <linux/io_uring.h>
+  #include <fcntl.h>
+  #include <poll.h>
+  #include <sys/eventfd.h>
+  #include <sys/mman.h>
+  #include <sys/syscall.h>
+  #include <sys/uio.h>
+  #include <unistd.h>
+
+  #include <cerrno>
+  #include <deque>
+#endif
+
+#include <sys/stat.h>
+
+#include <atomic>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace knight {
+namespace AsyncFile {
+
+namespace detail {
+
+struct ReadRequest {
+  std::string path;
+  FileData data;
+  Job *job;
+
+#if KNIGHT_HAS_IO_URING
+  int fd;
+  std::size_t offset;
+  iovec vector;
+#endif
+};
+
+} // namespace detail
+
+namespace {
+  using detail::ReadRequest;
+
+  void complete(ReadRequest *request, bool success) {
+    request->data.success = success;
+    if (!success) {
+      request->data.buffer.reset();
+      request->data.size = 0u;
+    }
+
+    JobSystem::run(request->job);
+  }
+
+  void read_blocking(ReadRequest *request) {
+    // Directories open fine and report a bogus size, pipes have none at all
+    struct stat status;
+    if (stat(request->path.c_str(), &status) != 0 || (status.st_mode & S_IFMT) != S_IFREG) {
+      complete(request, false);
+      return;
+    }
+
+    std::ifstream file{request->path, std::ios::binary};
+    if (file.fail()) {
+      complete(request, false);
+      return;
+    }
+
+    file.seekg(0, std::ios::end);
+    auto end = file.tellg();
+    if (file.fail() || end < 0) {
+      complete(request, false);
+      return;
+    }
+
+    auto size = static_cast<std::size_t>(end);
+    file.seekg(0, std::ios::beg);
+
+    request->data.buffer.reset(new char[size]);
+    request->data.size = size;
+    file.read(request->data.buffer.get(), size);
+
+    complete(request, !file.fail());
+  }
+
+#if KNIGHT_HAS_IO_URING
+  // Just enough of io_uring for batched reads, without depending on liburing
+  class IoUring {
+   public:
+    ~IoUring() {
+      if (fd_ < 0) {
+        return;
+      }
+
+      munmap(sqes_, sqes_size_);
+      munmap(cq_ring_, cq_ring_size_);
+      munmap(sq_ring_, sq_ring_size_);
+      close(fd_);
+    }
+
+    bool setup(uint32_t entries) {
+      io_uring_params params{};
+      fd_ = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+      if (fd_ < 0) {
+        return false;
+      }
+
+      sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+      cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+      sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+
+      sq_ring_ = map(sq_ring_size_, IORING_OFF_SQ_RING);
+      cq_ring_ = map(cq_ring_size_, IORING_OFF_CQ_RING);
+      sqes_ = static_cast<io_uring_sqe *>(map(sqes_size_, IORING_OFF_SQES));
+      if (sq_ring_ == MAP_FAILED || cq_ring_ == MAP_FAILED || sqes_ == MAP_FAILED) {
+        return false;
+      }
+
+      auto *sq = static_cast<char *>(sq_ring_);
+      sq_head_ = reinterpret_cast<uint32_t *>(sq + params.sq_off.head);
+      sq_tail_ = reinterpret_cast<uint32_t *>(sq + params.sq_off.tail);
+      sq_mask_ = *reinterpret_cast<uint32_t *>(sq + params.sq_off.ring_mask);
+      sq_array_ = reinterpret_cast<uint32_t *>(sq + params.sq_off.array);
+      sq_entries_ = params.sq_entries;
+
+      auto *cq = static_cast<char *>(cq_ring_);
+      cq_head_ = reinterpret_cast<uint32_t *>(cq + params.cq_off.head);
+      cq_tail_ = reinterpret_cast<uint32_t *>(cq + params.cq_off.tail);
+      cq_mask_ = *reinterpret_cast<uint32_t *>(cq + params.cq_off.ring_mask);
+      cqes_ = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+      return true;
+    }
+
+    uint32_t entries() const { return sq_entries_; }
+
+    // Only ever called from the thread owning the ring, nullptr when full
+    io_uring_sqe *next_sqe() {
+      auto tail = *sq_tail_;
+      if (tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) == sq_entries_) {
+        return nullptr;
+      }
+
+      auto index = tail & sq_mask_;
+      auto *sqe = &sqes_[index];
+      *sqe = io_uring_sqe{};
+      sq_array_[index] = index;
+      __atomic_store_n(sq_tail_, tail + 1u, __ATOMIC_RELEASE);
+      ++unsubmitted_;
+      return sqe;
+    }
+
+    // Submits everything prepared so far and blocks until at least one
+    // request completed
+    void submit_and_wait() {
+      auto result = syscall(__NR_io_uring_enter, fd_, unsubmitted_, 1u, IORING_ENTER_GETEVENTS, nullptr, 0u);
+      if (result >= 0) {
+        unsubmitted_ -= static_cast<uint32_t>(result);
+      } else {
+        XASSERT(errno == EINTR || errno == EAGAIN || errno == EBUSY, "io_uring_enter failed with %d", errno);
+      }
+    }
+
+    template<typename F>
+    void for_each_completion(F &&function) {
+      auto head = *cq_head_;
+      auto tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+      for (; head != tail; ++head) {
+        function(cqes_[head & cq_mask_]);
+      }
+      __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    }
+
+   private:
+    void *map(std::size_t size, uint64_t offset) {
+      return mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, static_cast<off_t>(offset));
+    }
+
+    int fd_ = -1;
+
+    void *sq_ring_ = MAP_FAILED;
+    void *cq_ring_ = MAP_FAILED;
+    io_uring_sqe *sqes_ = static_cast<io_uring_sqe *>(MAP_FAILED);
+    std::size_t sq_ring_size_ = 0u;
+    std::size_t cq_ring_size_ = 0u;
+    std::size_t sqes_size_ = 0u;
+
+    uint32_t *sq_head_ = nullptr;
+    uint32_t *sq_tail_ = nullptr;
+    uint32_t *sq_array_ = nullptr;
+    uint32_t sq_mask_ = 0u;
+    uint32_t sq_entries_ = 0u;
+    uint32_t unsubmitted_ = 0u;
+
+    uint32_t *cq_head_ = nullptr;
+    uint32_t *cq_tail_ = nullptr;
+    uint32_t cq_mask_ = 0u;
+    io_uring_cqe *cqes_ = nullptr;
+  };
+
+  // Completions carrying this instead of a request come from the eventfd
+  // submitting threads poke
+  const uint64_t kWakeUp = 0u;
+
+  IoUring *ring = nullptr;
+  std::thread ring_thread;
+  int wake_fd = -1;
+  uint32_t queue_depth = 0u;
+
+  std::mutex pending_mutex;
+  std::vector<ReadRequest *> pending_requests;
+  bool stopping = false;
+
+  bool open_request(ReadRequest *request) {
+    // Non-blocking so a FIFO does not hang the open, regular files ignore it
+    request->fd = open(request->path.c_str(), O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+    if (request->fd < 0) {
+      return false;
+    }
+
+    struct stat status;
+    if (fstat(request->fd, &status) != 0 || !S_ISREG(status.st_mode)) {
+      close(request->fd);
+      return false;
+    }
+
+    request->offset = 0u;
+    request->data.size = static_cast<std::size_t>(status.st_size);
+    request->data.buffer.reset(new char[request->data.size]);
+    return true;
+  }
+
+  void finish_request(ReadRequest *request, bool success) {
+    close(request->fd);
+    complete(request, success);
+  }
+
+  void prepare_read(io_uring_sqe *sqe, ReadRequest *request) {
+    request->vector.iov_base = request->data.buffer.get() + request->offset;
+    request->vector.iov_len = request->data.size - request->offset;
+
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = request->fd;
+    sqe->off = request->offset;
+    sqe->addr = reinterpret_cast<uint64_t>(&request->vector);
+    sqe->len = 1u;
+    sqe->user_data = reinterpret_cast<uint64_t>(request);
+  }
+
+  void prepare_wake_up(io_uring_sqe *sqe) {
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = wake_fd;
+    sqe->poll_events = POLLIN;
+    sqe->user_data = kWakeUp;
+  }
+
+  void ring_main() {
+    std::deque<ReadRequest *> waiting;
+    std::vector<ReadRequest *> incoming;
+    auto in_flight = 0u;
+    auto done = false;
+
+    prepare_wake_up(ring->next_sqe());
+
+    while (true) {
+      {
+        std::lock_guard<std::mutex> lock{pending_mutex};
+        incoming.swap(pending_requests);
+        done = stopping;
+      }
+
+      for (auto *request : incoming) {
+        if (!open_request(request)) {
+          complete(request, false);
+        } else if (request->data.size == 0u) {
+          finish_request(request, true);
+        } else {
+          waiting.push_back(request);
+        }
+      }
+      incoming.clear();
+
+      // One entry stays free for re-arming the wake up poll
+      while (!waiting.empty() && in_flight < queue_depth) {
+        prepare_read(ring->next_sqe(), waiting.front());
+        waiting.pop_front();
+        ++in_flight;
+      }
+
+      if (done && in_flight == 0u && waiting.empty()) {
+        break;
+      }
+
+      ring->submit_and_wait();
+      ring->for_each_completion([&](const io_uring_cqe &cqe) {
+        if (cqe.user_data == kWakeUp) {
+          eventfd_t value;
+          eventfd_read(wake_fd, &value);
+          prepare_wake_up(ring->next_sqe());
+          return;
+        }
+
+        auto *request = reinterpret_cast<ReadRequest *>(cqe.user_data);
+        --in_flight;
+
+        if (cqe.res == -EINTR || cqe.res == -EAGAIN) {
+          waiting.push_front(request);
+        } else if (cqe.res < 0) {
+          finish_request(request, false);
+        } else if (cqe.res == 0) {
+          // The file shrank since it was opened
+          request->data.size = request->offset;
+          finish_request(request, true);
+        } else {
+          request->offset += static_cast<std::size_t>(cqe.res);
+          if (request->offset < request->data.size) {
+            waiting.push_front(request);
+          } else {
+            finish_request(request, true);
+          }
+        }
+      });
+    }
+  }
+
+  bool start_io_uring(uint32_t depth) {
+    auto *new_ring = new IoUring{};
+    if (!new_ring->setup(depth + 1u)) {
+      delete new_ring;
+      return false;
+    }
+
+    wake_fd = eventfd(0u, EFD_CLOEXEC);
+    if (wake_fd < 0) {
+      delete new_ring;
+      return false;
+    }
+
+    ring = new_ring;
+    queue_depth = ring->entries() - 1u;
+    stopping = false;
+    ring_thread = std::thread{ring_main};
+    return true;
+  }
+
+  void stop_io_uring() {
+    {
+      std::lock_guard<std::mutex> lock{pending_mutex};
+      stopping = true;
+    }
+    eventfd_write(wake_fd, 1u);
+    ring_thread.join();
+
+    close(wake_fd);
+    wake_fd = -1;
+    delete ring;
+    ring = nullptr;
+  }
+#endif
+
+  ThreadPool *thread_pool = nullptr;
+} // namespace
+
+void initialize(const Config &config) {
+  XASSERT(thread_pool == nullptr, "AsyncFile initialized twice");
+
+#if KNIGHT_HAS_IO_URING
+  XASSERT(ring == nullptr, "AsyncFile initialized twice");
+  if (config.use_io_uring && start_io_uring(config.queue_depth)) {
+    return;
+  }
+#endif
+
+  thread_pool = new ThreadPool{config.thread_count};
+}
+
+void shutdown() {
+#if KNIGHT_HAS_IO_URING
+  if (ring != nullptr) {
+    stop_io_uring();
+  }
+#endif
+
+  if (thread_pool != nullptr) {
+    thread_pool->Sync();
+    delete thread_pool;
+    thread_pool = nullptr;
+  }
+}
+
+bool uses_io_uring() {
+#if KNIGHT_HAS_IO_URING
+  return ring != nullptr;
+#else
+  return false;
+#endif
+}
+
+detail::ReadRequest *detail::create_request(gsl::czstring<> path) {
+  auto *request = new ReadRequest{};
+  request->path = path;
+  request->data.path = request->path.c_str();
+  request->data.size = 0u;
+  request->data.success = false;
+  return request;
+}
+
+FileData &detail::request_data(ReadRequest *request) {
+  return request->data;
+}
+
+void detail::free_request(ReadRequest *request) {
+  delete request;
+}
+
+void detail::submit(ReadRequest *request, Job *job) {
+  request->job = job;
+
+#if KNIGHT_HAS_IO_URING
+  if (ring != nullptr) {
+    {
+      std::lock_guard<std::mutex> lock{pending_mutex};
+      pending_requests.push_back(request);
+    }
+    eventfd_write(wake_fd, 1u);
+    return;
+  }
+#endif
+
+  XASSERT(thread_pool != nullptr, "AsyncFile used before AsyncFile::initialize");
+  thread_pool->Enqueue([request] { read_blocking(request); });
+}
+
+} // namespace AsyncFile
+} // namespace knight
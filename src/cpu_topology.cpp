@@ -0,0 +1,142 @@
+#include "cpu_topology.h"
+
+#include <cstdio>
+#include <thread>
+
+#if defined(__linux__)
+  #include <dirent.h>
+  #include <pthread.h>
+  #include <sched.h>
+#elif defined(_WIN32)
+  #include <windows.h>
+#endif
+
+namespace knight {
+namespace cpu_topology {
+
+#if defined(__linux__)
+
+namespace {
+
+  bool read_line(const char *path, char *buffer, int size) {
+    auto *file = std::fopen(path, "r");
+    if (file == nullptr) {
+      return false;
+    }
+
+    auto *line = std::fgets(buffer, size, file);
+    std::fclose(file);
+    return line != nullptr;
+  }
+
+  // Lists look like "0-3,8-11", the first CPU is all we need to tell groups apart
+  int32_t first_cpu_in_list(const char *list) {
+    int cpu;
+    return std::sscanf(list, "%d", &cpu) == 1 ? cpu : kUnknown;
+  }
+
+} // namespace
+
+std::vector<uint32_t> available_cpus() {
+  std::vector<uint32_t> cpus;
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (auto cpu = 0u; cpu < CPU_SETSIZE; ++cpu) {
+      if (CPU_ISSET(cpu, &set)) {
+        cpus.push_back(cpu);
+      }
+    }
+  }
+
+  if (cpus.empty()) {
+    for (auto cpu = 0u; cpu < std::thread::hardware_concurrency(); ++cpu) {
+      cpus.push_back(cpu);
+    }
+  }
+
+  return cpus;
+}
+
+int32_t cache_group(uint32_t cpu) {
+  char path[128];
+  char line[256];
+
+  // The highest cache level found wins
+  auto group = kUnknown;
+  for (auto index = 0; ; ++index) {
+    std::snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/cache/index%d/shared_cpu_list", cpu, index);
+    if (!read_line(path, line, sizeof(line))) {
+      break;
+    }
+    group = first_cpu_in_list(line);
+  }
+
+  return group;
+}
+
+int32_t numa_node(uint32_t cpu) {
+  char path[128];
+  std::snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u", cpu);
+
+  auto *directory = opendir(path);
+  if (directory == nullptr) {
+    return kUnknown;
+  }
+
+  auto node = kUnknown;
+  while (auto *entry = readdir(directory)) {
+    int id;
+    if (std::sscanf(entry->d_name, "node%d", &id) == 1) {
+      node = id;
+      break;
+    }
+  }
+
+  closedir(directory);
+  return node;
+}
+
+bool pin_current_thread(uint32_t cpu) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+#else
+
+std::vector<uint32_t> available_cpus() {
+  std::vector<uint32_t> cpus;
+  for (auto cpu = 0u; cpu < std::thread::hardware_concurrency(); ++cpu) {
+    cpus.push_back(cpu);
+  }
+  return cpus;
+}
+
+int32_t cache_group(uint32_t) {
+  return kUnknown;
+}
+
+int32_t numa_node(uint32_t) {
+  return kUnknown;
+}
+
+#if defined(_WIN32)
+bool pin_current_thread(uint32_t cpu) {
+  if (cpu >= 64u) {
+    return false;
+  }
+  return SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR{1} << cpu) != 0;
+}
+#else
+bool pin_current_thread(uint32_t) {
+  return false;
+}
+#endif
+
+#endif
+
+} // namespace cpu_topology
+} // namespace knight
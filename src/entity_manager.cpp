@@ -14,7 +14,23 @@ Entity *EntityManager::get(Entity::ID id) const {
 
 void EntityManager::destroy(Entity::ID id) {
   XASSERT(alive(id), "Cannot destroy non-existent Entity");
-  entities_.destroy(id);
+  entities_.retire(id);
+  destroyed_.push_back(id);
+}
+
+void EntityManager::create(gsl::span<Entity::ID> ids) {
+  entities_.create(ids);
+}
+
+void EntityManager::destroy(gsl::span<const Entity::ID> ids) {
+  // Record first, ids may be a range of entities() that destroying reorders
+  destroyed_.insert(destroyed_.end(), ids.begin(), ids.end());
+  entities_.retire(ids);
+}
+
+void EntityManager::clear_destroyed() {
+  entities_.release(destroyed());
+  destroyed_.clear();
 }
 
 bool EntityManager::alive(Entity::ID id) const {
@@ -0,0 +1,60 @@
+#include "fiber.h"
+
+#if KNIGHT_HAS_FIBERS
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstdint>
+
+namespace knight {
+
+Fiber::Fiber()
+  : stack_{nullptr},
+    stack_size_{0u},
+    function_{nullptr},
+    argument_{nullptr} { }
+
+Fiber::Fiber(Function function, void *argument, std::size_t stack_size)
+  : function_{function},
+    argument_{argument} {
+  // Round up to whole pages and add one at the bottom to catch overflows
+  auto page_size = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+  stack_size_ = ((stack_size + page_size - 1u) / page_size + 1u) * page_size;
+
+  stack_ = mmap(nullptr, stack_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+  XASSERT(stack_ != MAP_FAILED, "Failed to allocate fiber stack of %zu bytes", stack_size_);
+  mprotect(stack_, page_size, PROT_NONE);
+
+  auto result = getcontext(&context_);
+  XASSERT(result == 0, "getcontext failed");
+
+  context_.uc_stack.ss_sp = static_cast<char *>(stack_) + page_size;
+  context_.uc_stack.ss_size = stack_size_ - page_size;
+  context_.uc_link = nullptr;
+
+  // makecontext only passes ints along
+  auto self = reinterpret_cast<uintptr_t>(this);
+  makecontext(&context_, reinterpret_cast<void(*)()>(&Fiber::entry), 2,
+    static_cast<unsigned int>(self >> 32), static_cast<unsigned int>(self & 0xffffffffu));
+}
+
+Fiber::~Fiber() {
+  if (stack_ != nullptr) {
+    munmap(stack_, stack_size_);
+  }
+}
+
+void Fiber::switch_to(Fiber &from, Fiber &to) {
+  swapcontext(&from.context_, &to.context_);
+}
+
+void Fiber::entry(unsigned int high, unsigned int low) {
+  auto *fiber = reinterpret_cast<Fiber *>((static_cast<uintptr_t>(high) << 32) | low);
+  fiber->function_(fiber->argument_);
+  XASSERT(false, "Fiber function returned");
+}
+
+} // namespace knight
+
+#endif
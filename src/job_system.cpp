@@ -1,197 +1,1252 @@
 #include "job_system.h"
 #include "common.h"
+#include "cpu_topology.h"
+#include "event_count.h"
+#include "fiber.h"
+#include "job_trace.h"
 #include "random.h"
-#include "semaphore.h"
+#include "work_stealing_queue.h"
 
+#include <algorithm>
+#include <chrono>
+#include <deque>
 #include <limits>
+#include <new>
 #include <thread>
 #include <mutex>
 #include <vector>
 
+#if KNIGHT_HAS_FIBERS
+  // Fibers can move to another thread while they are suspended. Everything
+  // that reads a thread_local goes through a function that cannot be inlined,
+  // so no thread_local address gets cached across a switch.
+  #define KNIGHT_FIBER_SAFE __attribute__((noinline))
+#else
+  #define KNIGHT_FIBER_SAFE
+#endif
+
 namespace knight {
+
+namespace JobSystem { struct FiberContext; }
+
+// Links a job to one of its continuations, to a fiber waiting on it, or to a
+// counter it brings down when done
+struct JobEdge {
+  Job *job;
+  JobSystem::FiberContext *fiber;
+  JobCounter *counter;
+
+  // Fiber edges are shared between the waiting side and the finishing job,
+  // the first to claim the edge resumes the fiber and the last one out
+  // releases it
+  std::atomic<uint32_t> references;
+  std::atomic<bool> claimed;
+
+  union {
+    JobEdge *next;
+    JobEdge *next_free;
+  };
+  uint32_t pool;
+};
+
+// Only freed once back at zero, which also leaves it without waiters, so a
+// recycled counter is ready for use as is. Someone still waking waiters of its
+// previous life only resumes fibers whose value has been reached anyway.
+struct JobCounter {
+  std::atomic<int32_t> value{0};
+
+  // Fibers waiting for value to come down, linked through next_waiter
+  std::atomic<uint32_t> waiter_count{0u};
+  std::mutex mutex;
+  JobSystem::FiberContext *waiters = nullptr;
+
+  JobCounter *next_free;
+  uint32_t pool;
+};
+
 namespace JobSystem {
 
-class WorkStealingQueue {
-  static const int64_t kNumberOfJobs = 4096u;
-  static const int64_t kMask = kNumberOfJobs - 1u;
+// Owns every job (or edge) created on one thread. Only the owner allocates,
+// any thread may hand a finished item back.
+template<typename T>
+class Pool {
+  static const uint32_t kItemsPerBlock = 4096u;
+  static const uint32_t kMaxBlockCount = 64u;
 
  public:
-  WorkStealingQueue()
-    : bottom_{0},
-      top_{0} { }
+  explicit Pool(uint32_t index)
+    : index_{index},
+      local_free_{nullptr},
+      remote_free_{nullptr} { }
 
-  void push(Job *job);
-  Job *pop();
-  Job *steal();
+  ~Pool() {
+    for (auto &&block : blocks_) {
+      delete[] block;
+    }
+  }
+
+  // Returns nullptr once the pool cannot grow any further
+  T *allocate() {
+    if (local_free_ == nullptr) {
+      local_free_ = remote_free_.exchange(nullptr, std::memory_order_acquire);
+    }
+
+    if (local_free_ == nullptr && !grow()) {
+      return nullptr;
+    }
+
+    auto *item = local_free_;
+    local_free_ = item->next_free;
+    return item;
+  }
+
+  void release(T *item, uint32_t thread_index) {
+    if (thread_index == index_) {
+      item->next_free = local_free_;
+      local_free_ = item;
+      return;
+    }
+
+    auto *head = remote_free_.load(std::memory_order_relaxed);
+    do {
+      item->next_free = head;
+    } while (!remote_free_.compare_exchange_weak(head, item, std::memory_order_release, std::memory_order_relaxed));
+  }
 
  private:
-  std::mutex mutex_;
-  Job *jobs_[kNumberOfJobs];
-  std::atomic<int64_t> bottom_;
-  std::atomic<int64_t> top_;
+  bool grow() {
+    if (blocks_.size() == kMaxBlockCount) {
+      return false;
+    }
+
+    auto *block = new char[kItemsPerBlock * sizeof(T) + alignof(T)];
+    auto *items = reinterpret_cast<T *>(memory_block::align_forward(reinterpret_cast<uintptr_t>(block), alignof(T)));
+
+    for (auto i = kItemsPerBlock; i-- > 0u;) {
+      auto *item = new (&items[i]) T;
+      item->pool = index_;
+      item->next_free = local_free_;
+      local_free_ = item;
+    }
+
+    blocks_.push_back(block);
+    return true;
+  }
+
+  const uint32_t index_;
+  T *local_free_;
+  std::vector<char *> blocks_;
+
+  // Keeps the owner's fields off the line other threads write to
+  char padding_[CACHE_LINE_SIZE];
+  std::atomic<T *> remote_free_;
+};
+
+// Bounded multi-producer, multi-consumer queue (Vyukov) jobs from threads
+// outside the job system come in through. Its owner drains it into its
+// deque, thieves may take from it too.
+class Inbox {
+  static const uint64_t kCapacity = 1024u;
+  static const uint64_t kMask = kCapacity - 1u;
+
+ public:
+  Inbox() : enqueue_{0u}, dequeue_{0u} {
+    for (auto i = 0u; i < kCapacity; ++i) {
+      cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  // Returns false when full
+  bool push(Job *job) {
+    auto position = enqueue_.load(std::memory_order_relaxed);
+    while (true) {
+      auto &cell = cells_[position & kMask];
+      auto difference = static_cast<int64_t>(cell.sequence.load(std::memory_order_acquire) - position);
+      if (difference == 0) {
+        if (enqueue_.compare_exchange_weak(position, position + 1u, std::memory_order_relaxed)) {
+          cell.job = job;
+          cell.sequence.store(position + 1u, std::memory_order_release);
+          return true;
+        }
+      } else if (difference < 0) {
+        return false;
+      } else {
+        position = enqueue_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  Job *pop() {
+    auto position = dequeue_.load(std::memory_order_relaxed);
+    while (true) {
+      auto &cell = cells_[position & kMask];
+      auto difference = static_cast<int64_t>(cell.sequence.load(std::memory_order_acquire) - (position + 1u));
+      if (difference == 0) {
+        if (dequeue_.compare_exchange_weak(position, position + 1u, std::memory_order_relaxed)) {
+          auto *job = cell.job;
+          cell.sequence.store(position + kCapacity, std::memory_order_release);
+          return job;
+        }
+      } else if (difference < 0) {
+        return nullptr;
+      } else {
+        position = dequeue_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+ private:
+  struct Cell {
+    std::atomic<uint64_t> sequence;
+    Job *job;
+  };
+
+  Cell cells_[kCapacity];
+  std::atomic<uint64_t> enqueue_;
+  char padding_[CACHE_LINE_SIZE];
+  std::atomic<uint64_t> dequeue_;
+};
+
+struct JobQueues {
+  WorkStealingQueue<Job *> lanes[kJobPriorityCount];
+  Inbox inbox;
+};
+
+// Bump allocator for job payloads that do not fit inline. Only the owning
+// thread allocates and resets it, any thread may release what it handed out.
+class FrameArena {
+  static const std::size_t kBlockSize = 64_kib;
+
+ public:
+  FrameArena() : block_{0u}, offset_{0u}, live_{0u} { }
+
+  ~FrameArena() {
+    for (auto &&block : blocks_) {
+      delete[] block.memory;
+    }
+  }
+
+  void *allocate(std::size_t size, std::size_t align) {
+    while (true) {
+      if (block_ < blocks_.size()) {
+        auto &block = blocks_[block_];
+        auto base = reinterpret_cast<uintptr_t>(block.memory);
+        auto start = memory_block::align_forward(base + offset_, align);
+        if (start + size <= base + block.size) {
+          offset_ = start + size - base;
+          live_.fetch_add(1u, std::memory_order_relaxed);
+          return reinterpret_cast<void *>(start);
+        }
+
+        ++block_;
+        offset_ = 0u;
+        continue;
+      }
+
+      // Blocks are kept across resets, so this only happens while warming up
+      auto block_size = std::max(kBlockSize, size + align);
+      blocks_.push_back(Block{new char[block_size], block_size});
+    }
+  }
+
+  void release() {
+    live_.fetch_sub(1u, std::memory_order_release);
+  }
+
+  bool empty() const {
+    return live_.load(std::memory_order_acquire) == 0u;
+  }
+
+  void reset() {
+    block_ = 0u;
+    offset_ = 0u;
+  }
+
+ private:
+  struct Block {
+    char *memory;
+    std::size_t size;
+  };
+
+  std::vector<Block> blocks_;
+  std::size_t block_;
+  std::size_t offset_;
+  std::atomic<uint32_t> live_;
+
+  KNIGHT_DISALLOW_COPY_AND_ASSIGN(FrameArena);
+};
+
+// A thread starts its current arena over whenever every payload in it has
+// been released, and otherwise moves on to a fresh arena on the first payload
+// of every frame. Arenas still holding payloads of jobs in flight are skipped,
+// if all of them are busy the current one simply keeps growing.
+struct PayloadArenas {
+  static const uint32_t kArenaCount = 3u;
+
+  PayloadArenas() : current{0u}, frame{0u} { }
+
+  FrameArena arenas[kArenaCount];
+  uint32_t current;
+  uint32_t frame;
+};
+
+// Stored in Job::data of a job whose payload was spilled
+struct SpilledPayload {
+  void *data;
+  FrameArena *arena;
 };
 
 namespace {
+  // Written only by the owning thread, read by anyone asking for statistics
+  struct WorkerStatistics {
+    std::atomic<uint64_t> steal_attempts{0};
+    std::atomic<uint64_t> steal_successes{0};
+    std::atomic<uint64_t> steal_failures{0};
+    char padding[CACHE_LINE_SIZE - 3 * sizeof(std::atomic<uint64_t>)];
+  };
+
+  // Steal victims of one thread, closest first. Each tier ends at the
+  // matching entry of tier_ends.
+  struct Neighbours {
+    std::vector<uint32_t> victims;
+    std::vector<uint32_t> tier_ends;
+  };
+
+  const uint32_t kInvalidThreadIndex = std::numeric_limits<uint32_t>::max();
+  const int32_t kUnpinned = -1;
+
+  // How many times an idle thread looks for work before going to sleep
+  const uint32_t kSpinCount = 64u;
+
   std::vector<std::thread> work_threads;
-  std::vector<WorkStealingQueue *> job_queues;
-  std::vector<Semaphore *> wait_events;
+  std::vector<JobQueues *> job_queues;
+  std::vector<Pool<Job> *> job_pools;
+  std::vector<Pool<JobEdge> *> edge_pools;
+  std::vector<Pool<JobCounter> *> counter_pools;
+  std::vector<WorkerStatistics *> worker_statistics;
+  std::vector<PayloadArenas *> payload_arenas;
+  std::atomic<uint32_t> frame_index{0u};
+  std::vector<Neighbours> neighbours;
 
-  bool worker_thread_active;
+  // May be changed while workers are stealing, so the fields of StealPolicy
+  // are kept apart
+  std::atomic<uint32_t> steal_victim_count{StealPolicy{}.victim_count};
+  std::atomic<uint32_t> steal_batch_size{StealPolicy{}.batch_size};
 
-  Semaphore job_ready;
-  Semaphore job_finished{0, 1};
+  const int64_t kUnlimitedBudget = -1;
 
-  uint32_t get_thread_index() {
-    static std::atomic<uint32_t> thread_count;
-    thread_local uint32_t thread_index = thread_count++;
-    return thread_index;
+  // Nanoseconds, summed over every thread
+  std::atomic<int64_t> background_budget{kUnlimitedBudget};
+  std::atomic<int64_t> background_time_spent{0};
+
+  // Startup handshake, workers allocate their own state before any of them
+  // starts looking for work
+  std::atomic<uint32_t> workers_ready{0u};
+  std::atomic<bool> workers_started{false};
+
+  std::atomic<bool> worker_thread_active;
+
+  // Workers with nothing to do sleep on job_available, threads blocked in
+  // wait() sleep on job_completed
+  EventCount job_available;
+  EventCount job_completed;
+
+  // Bumped by every initialize(), thread indices from an earlier run are stale
+  std::atomic<uint32_t> system_generation{0u};
+
+  thread_local uint32_t current_thread_index = kInvalidThreadIndex;
+  thread_local uint32_t current_thread_generation = 0u;
+
+  // Slots for threads outside the job system, handed out the first time such
+  // a thread needs one and given back when it exits
+  std::mutex external_slot_mutex;
+  std::vector<uint32_t> free_external_slots;
+
+  struct ExternalSlot {
+    uint32_t index = kInvalidThreadIndex;
+    uint32_t generation = 0u;
+
+    ~ExternalSlot() {
+      std::lock_guard<std::mutex> lock{external_slot_mutex};
+      if (index != kInvalidThreadIndex && generation == system_generation.load(std::memory_order_relaxed)) {
+        free_external_slots.push_back(index);
+      }
+    }
+  };
+
+  thread_local ExternalSlot external_slot;
+
+  void set_thread_index(uint32_t index) {
+    current_thread_index = index;
+    current_thread_generation = system_generation.load(std::memory_order_relaxed);
+  }
+
+  void claim_external_slot() {
+    std::lock_guard<std::mutex> lock{external_slot_mutex};
+    XASSERT(!free_external_slots.empty(),
+      "Too many threads outside the job system, raise JobSystem::Config::external_thread_count");
+
+    external_slot.index = free_external_slots.back();
+    external_slot.generation = system_generation.load(std::memory_order_relaxed);
+    free_external_slots.pop_back();
+
+    set_thread_index(external_slot.index);
+  }
+
+  KNIGHT_FIBER_SAFE uint32_t get_thread_index() {
+    if (current_thread_generation != system_generation.load(std::memory_order_relaxed)) {
+      claim_external_slot();
+    }
+    return current_thread_index;
+  }
+
+  Job *get_job(JobPriority lowest = JobPriority::Background, bool within_budget = true);
+  void execute(Job *job);
+
+  bool is_complete(const Job *job) {
+    return job->unfinished_jobs == 0;
+  }
+
+  // Marks a job that finished and takes no more continuations
+  JobEdge *const kSealed = reinterpret_cast<JobEdge *>(uintptr_t{1u});
+
+  template<typename T>
+  T *allocate_from(std::vector<Pool<T> *> &pools) {
+    auto *item = pools[get_thread_index()]->allocate();
+
+    // Every slot is in flight, help out until some of them come back. The
+    // pool is looked up again each time, a job we run may move us.
+    while (item == nullptr) {
+      auto *next_job = get_job();
+      if (next_job != nullptr) {
+        execute(next_job);
+      } else {
+        std::this_thread::yield();
+      }
+      item = pools[get_thread_index()]->allocate();
+    }
+
+    return item;
   }
 
   Job *allocate_job() {
-    const uint32_t kMaxJobCount = 4096;
-    thread_local Job job_allocator[kMaxJobCount];
-    thread_local uint32_t allocated_jobs = 0u;
-    auto index = allocated_jobs++;
-    return &job_allocator[index & (kMaxJobCount-1u)];
+    return allocate_from(job_pools);
+  }
+
+  void release_job(Job *job) {
+    // Invalidates every handle to the finished job
+    job->generation.fetch_add(1u, std::memory_order_release);
+    job_pools[job->pool]->release(job, get_thread_index());
+  }
+
+  JobEdge *allocate_edge() {
+    auto *edge = allocate_from(edge_pools);
+    edge->fiber = nullptr;
+    edge->counter = nullptr;
+    return edge;
+  }
+
+  void release_edge(JobEdge *edge) {
+    edge_pools[edge->pool]->release(edge, get_thread_index());
   }
 
-  WorkStealingQueue *get_worker_thread_queue() {
-    return job_queues[get_thread_index()];
+  // Threads outside the job system have no queues
+  JobQueues *get_worker_thread_queues() {
+    auto index = get_thread_index();
+    return index < job_queues.size() ? job_queues[index] : nullptr;
+  }
+
+  uint32_t lane_index(JobPriority priority) {
+    return static_cast<uint32_t>(priority);
+  }
+
+  bool background_budget_left() {
+    auto budget = background_budget.load(std::memory_order_relaxed);
+    return budget == kUnlimitedBudget ||
+      background_time_spent.load(std::memory_order_relaxed) < budget;
+  }
+
+  // Number of lanes, counted from the highest priority, a thread may take from
+  uint32_t lane_count(JobPriority lowest, bool within_budget) {
+    auto count = lane_index(lowest) + 1u;
+    if (count == kJobPriorityCount && within_budget && !background_budget_left()) {
+      --count;
+    }
+    return count;
   }
 
   bool is_empty_job(const Job *job) {
-    return job == nullptr || has_job_completed(job);
+    return job == nullptr || is_complete(job);
   }
 
-  Job *get_job() {
-    auto *queue = get_worker_thread_queue();
-    auto *job = queue->pop();
+  void increment(std::atomic<uint64_t> &counter) {
+    counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  }
 
-    if (is_empty_job(job)) {
-      auto index = 0;//random_in_range(0, (int)(job_queues.size() - 1));
-      auto *steal_queue = job_queues[index];
-      if (steal_queue == queue) {
-        return nullptr;
+  // Jobs from outside threads whose owner has not got round to them yet. One
+  // we may not run right now is queued with us instead.
+  Job *steal_from_inbox(JobQueues &victim_queues, JobQueues &queues, uint32_t lanes) {
+    auto *job = victim_queues.inbox.pop();
+    if (job != nullptr && lane_index(job->priority) >= lanes) {
+      queues.lanes[lane_index(job->priority)].push(job);
+      return nullptr;
+    }
+    return job;
+  }
+
+  Job *steal_from_tier(JobQueues &queues, uint32_t lanes, WorkerStatistics &statistics,
+                       const uint32_t *victims, uint32_t victim_count) {
+    auto probe_count = steal_victim_count.load(std::memory_order_relaxed);
+    for (auto i = 0u; i < probe_count; ++i) {
+      auto victim_index = victims[random_in_range(0u, victim_count - 1u)];
+      auto &victim_queues = *job_queues[victim_index];
+
+      increment(statistics.steal_attempts);
+
+      // Higher lanes are drained first
+      Job *job = nullptr;
+      auto lane = 0u;
+      for (; lane < lanes; ++lane) {
+        job = victim_queues.lanes[lane].steal();
+        if (!is_empty_job(job)) {
+          break;
+        }
       }
 
-      auto *stolen_job = steal_queue->steal();
-      if (is_empty_job(stolen_job)) {
-        return nullptr;
+      if (is_empty_job(job)) {
+        job = steal_from_inbox(victim_queues, queues, lanes);
+        if (job != nullptr) {
+          increment(statistics.steal_successes);
+          return job;
+        }
+
+        increment(statistics.steal_failures);
+        continue;
+      }
+      increment(statistics.steal_successes);
+      JobTrace::record(get_thread_index(), JobTrace::Event::Steal, reinterpret_cast<const void *>(job->function));
+
+      auto *victim = &victim_queues.lanes[lane];
+      auto *queue = &queues.lanes[lane];
+
+      // Take up to half of what is left so the victim keeps working on its own
+      // backlog while we chew through ours without coming back for more
+      auto batch = std::min<int64_t>(steal_batch_size.load(std::memory_order_relaxed) - 1, victim->size() / 2);
+      for (auto j = 0; j < batch; ++j) {
+        auto *extra_job = victim->steal();
+        if (is_empty_job(extra_job)) {
+          break;
+        }
+        queue->push(extra_job);
       }
 
-      return stolen_job;
+      if (batch > 0) {
+        job_available.notify();
+      }
+
+      return job;
+    }
+
+    return nullptr;
+  }
+
+  Job *steal_job(JobQueues &queues, uint32_t lanes) {
+    auto index = get_thread_index();
+    auto &statistics = *worker_statistics[index];
+    auto &candidates = neighbours[index];
+
+    auto tier_begin = 0u;
+    for (auto tier_end : candidates.tier_ends) {
+      auto *job = steal_from_tier(queues, lanes, statistics, &candidates.victims[tier_begin], tier_end - tier_begin);
+      if (job != nullptr) {
+        return job;
+      }
+      tier_begin = tier_end;
+    }
+
+    return nullptr;
+  }
+
+  // Only ever drained by the main thread, jobs bound to it are rare enough for
+  // a lock
+  std::mutex main_thread_mutex;
+  std::deque<Job *> main_thread_jobs;
+  std::atomic<uint32_t> main_thread_job_count{0u};
+
+  Job *pop_main_thread_job(uint32_t lanes) {
+    if (main_thread_job_count.load(std::memory_order_acquire) == 0u) {
+      return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock{main_thread_mutex};
+    auto it = std::find_if(main_thread_jobs.begin(), main_thread_jobs.end(), [lanes](const Job *job) {
+      return lane_index(job->priority) < lanes;
+    });
+    if (it == main_thread_jobs.end()) {
+      return nullptr;
     }
 
+    auto *job = *it;
+    main_thread_jobs.erase(it);
+    main_thread_job_count.fetch_sub(1u, std::memory_order_relaxed);
     return job;
   }
 
-  void notify_all_waiting() {
-    for (auto &&wait_event : wait_events) {
-      wait_event->notify();
+  void push_main_thread_job(Job *job) {
+    {
+      std::lock_guard<std::mutex> lock{main_thread_mutex};
+      main_thread_jobs.push_back(job);
+      main_thread_job_count.fetch_add(1u, std::memory_order_release);
+    }
+
+    // The main thread sleeps on job_completed while it waits
+    job_completed.notify_all();
+  }
+
+  Job *get_job(JobPriority lowest, bool within_budget) {
+    auto *own_queues = get_worker_thread_queues();
+    if (own_queues == nullptr) {
+      return nullptr;
+    }
+
+    auto &queues = *own_queues;
+    auto lanes = lane_count(lowest, within_budget);
+
+    if (get_thread_index() == 0u) {
+      auto *job = pop_main_thread_job(lanes);
+      if (job != nullptr) {
+        return job;
+      }
+    }
+
+    while (auto *job = queues.inbox.pop()) {
+      queues.lanes[lane_index(job->priority)].push(job);
+    }
+
+    for (auto lane = 0u; lane < lanes; ++lane) {
+      auto *job = queues.lanes[lane].pop();
+      if (!is_empty_job(job)) {
+        return job;
+      }
+    }
+
+    return steal_job(queues, lanes);
+  }
+
+  std::atomic<uint32_t> next_inbox{0u};
+
+  // Spreads jobs from outside threads over the inboxes of the main thread and
+  // the workers, whoever looks first runs them
+  void submit_external(Job *job) {
+    auto owner_count = static_cast<uint32_t>(job_queues.size());
+    auto first = next_inbox.fetch_add(1u, std::memory_order_relaxed);
+
+    while (true) {
+      for (auto i = 0u; i < owner_count; ++i) {
+        auto index = (first + i) % owner_count;
+        if (job_queues[index]->inbox.push(job)) {
+          // Every thread of the job system may be blocked in wait(), those
+          // sleep on job_completed
+          job_available.notify();
+          job_completed.notify_all();
+          return;
+        }
+      }
+
+      // Every inbox is full, give the workers a moment to catch up
+      std::this_thread::yield();
+    }
+  }
+
+  void push(Job *job) {
+    if (job->main_thread) {
+      push_main_thread_job(job);
+      return;
+    }
+
+    auto *queues = get_worker_thread_queues();
+    if (queues == nullptr) {
+      submit_external(job);
+      return;
+    }
+
+    queues->lanes[lane_index(job->priority)].push(job);
+    job_available.notify();
+  }
+
+  void satisfy_dependency(Job *job) {
+    if (--job->dependencies == 0) {
+      push(job);
+    }
+  }
+
+  void make_ready(FiberContext *context);
+
+  void resume_waiter(JobEdge *edge) {
+    if (!edge->claimed.exchange(true, std::memory_order_acq_rel)) {
+      make_ready(edge->fiber);
+    }
+  }
+
+  void drop_reference(JobEdge *edge) {
+    if (edge->references.fetch_sub(1u, std::memory_order_acq_rel) == 1u) {
+      release_edge(edge);
+    }
+  }
+
+  void wake_counter_waiters(JobCounter *counter);
+
+  void decrement_counter(JobCounter *counter) {
+    counter->value.fetch_sub(1, std::memory_order_seq_cst);
+
+    // Pairs with the registration in suspend_on_counter(), either we see the
+    // waiter or it sees the new value
+    if (counter->waiter_count.load(std::memory_order_seq_cst) != 0u) {
+      wake_counter_waiters(counter);
     }
   }
 
   void finish(Job *job) {
     const int32_t unfinished_jobs = --job->unfinished_jobs;
 
-    if (unfinished_jobs == 0 && job->parent != nullptr) {
-      finish(job->parent);
+    if (unfinished_jobs == 0) {
+      auto *parent = job->parent;
+      auto *edge = job->continuations.exchange(kSealed, std::memory_order_acq_rel);
+      release_job(job);
+
+      while (edge != nullptr) {
+        auto *next = edge->next;
+        if (edge->fiber != nullptr) {
+          resume_waiter(edge);
+          drop_reference(edge);
+        } else if (edge->counter != nullptr) {
+          auto *counter = edge->counter;
+          release_edge(edge);
+          decrement_counter(counter);
+        } else {
+          auto *continuation = edge->job;
+          release_edge(edge);
+          satisfy_dependency(continuation);
+        }
+        edge = next;
+      }
+
+      if (parent != nullptr) {
+        finish(parent);
+      }
+
+      job_completed.notify_all();
+    }
+  }
+
+  FrameArena &current_arena() {
+    auto &arenas = *payload_arenas[get_thread_index()];
+
+    // Nothing handed out is still in use, start over from the first block.
+    // Keeps threads that never see begin_frame() from growing forever.
+    auto &current = arenas.arenas[arenas.current];
+    if (current.empty()) {
+      current.reset();
+      return current;
+    }
+
+    auto frame = frame_index.load(std::memory_order_relaxed);
+    if (arenas.frame != frame) {
+      arenas.frame = frame;
+
+      for (auto i = 0u; i < PayloadArenas::kArenaCount; ++i) {
+        auto next = (arenas.current + i) % PayloadArenas::kArenaCount;
+        if (arenas.arenas[next].empty()) {
+          arenas.arenas[next].reset();
+          arenas.current = next;
+          break;
+        }
+      }
     }
 
-    notify_all_waiting();
+    return arenas.arenas[arenas.current];
   }
 
   void execute(Job *job) {
-    (job->function)(job, job->data);
+    // A job suspended on a fiber ends its slice on this thread and begins a
+    // new one wherever it is resumed, see suspend()
+    auto *function = reinterpret_cast<const void *>(job->function);
+    JobTrace::record(get_thread_index(), JobTrace::Event::Begin, function);
+
+    SpilledPayload spilled{job->data, nullptr};
+    if (job->spilled) {
+      memcpy(&spilled, job->data, sizeof(spilled));
+    }
+
+    if (job->priority == JobPriority::Background) {
+      auto start = std::chrono::steady_clock::now();
+      (job->function)(job, spilled.data);
+      auto elapsed = std::chrono::steady_clock::now() - start;
+      background_time_spent.fetch_add(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(),
+        std::memory_order_relaxed);
+    } else {
+      (job->function)(job, spilled.data);
+    }
+
+    if (spilled.arena != nullptr) {
+      spilled.arena->release();
+    }
+
+    JobTrace::record(get_thread_index(), JobTrace::Event::End, function);
     finish(job);
   }
 
-  void worker_thread(Semaphore &ready, bool &worker_thread_active) {
-    ready.notify();
-    while(worker_thread_active) {
+  void sleep(EventCount &event_count, EventCount::Key key) {
+    auto thread_index = get_thread_index();
+    JobTrace::record(thread_index, JobTrace::Event::Sleep);
+    event_count.wait(key);
+    JobTrace::record(thread_index, JobTrace::Event::Wake);
+  }
+
+  Job *spin_for_job() {
+    for (auto i = 0u; i < kSpinCount; ++i) {
       auto *job = get_job();
       if (job != nullptr) {
+        return job;
+      }
+      cpu_relax();
+    }
+    return nullptr;
+  }
+
+#if KNIGHT_HAS_FIBERS
+  enum class FiberState {
+    Running,
+    Idle,
+    Waiting
+  };
+
+  void fiber_main(void *argument);
+#endif
+} // namespace
+
+#if KNIGHT_HAS_FIBERS
+struct FiberContext {
+  FiberContext()
+    : fiber{fiber_main, this},
+      next_job{nullptr},
+      state{FiberState::Idle},
+      function{nullptr},
+      wait_handle{nullptr, 0u, JobPriority::Normal},
+      wait_counter{nullptr},
+      wait_value{0},
+      next_waiter{nullptr} { }
+
+  Fiber fiber;
+  Job *next_job;
+  FiberState state;
+
+  // Function of the job running on the fiber, for JobTrace
+  const void *function;
+
+  // What the fiber is suspended on, a job or a counter
+  JobHandle wait_handle;
+  JobCounter *wait_counter;
+  int32_t wait_value;
+  FiberContext *next_waiter;
+};
+#endif
+
+namespace {
+  bool use_fibers = false;
+
+#if KNIGHT_HAS_FIBERS
+  struct FiberWorker {
+    Fiber *scheduler;
+    FiberContext *current;
+  };
+
+  thread_local FiberWorker *fiber_worker = nullptr;
+
+  KNIGHT_FIBER_SAFE FiberWorker *current_fiber_worker() {
+    return fiber_worker;
+  }
+
+  void set_fiber_worker(FiberWorker *worker) {
+    fiber_worker = worker;
+  }
+
+  std::mutex fiber_mutex;
+  std::vector<FiberContext *> all_fibers;
+  std::vector<FiberContext *> free_fibers;
+  std::deque<FiberContext *> ready_fibers;
+  std::atomic<uint32_t> ready_fiber_count{0u};
+
+  FiberContext *acquire_fiber() {
+    std::lock_guard<std::mutex> lock{fiber_mutex};
+    if (free_fibers.empty()) {
+      all_fibers.push_back(new FiberContext{});
+      return all_fibers.back();
+    }
+
+    auto *context = free_fibers.back();
+    free_fibers.pop_back();
+    return context;
+  }
+
+  void release_fiber(FiberContext *context) {
+    std::lock_guard<std::mutex> lock{fiber_mutex};
+    free_fibers.push_back(context);
+  }
+
+  FiberContext *pop_ready_fiber() {
+    if (ready_fiber_count.load(std::memory_order_acquire) == 0u) {
+      return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock{fiber_mutex};
+    if (ready_fibers.empty()) {
+      return nullptr;
+    }
+
+    auto *context = ready_fibers.front();
+    ready_fibers.pop_front();
+    ready_fiber_count.fetch_sub(1u, std::memory_order_relaxed);
+    return context;
+  }
+
+  void make_ready(FiberContext *context) {
+    {
+      std::lock_guard<std::mutex> lock{fiber_mutex};
+      ready_fibers.push_back(context);
+      ready_fiber_count.fetch_add(1u, std::memory_order_release);
+    }
+    job_available.notify();
+  }
+
+  void switch_to_scheduler(FiberContext *context, FiberState state) {
+    context->state = state;
+    Fiber::switch_to(context->fiber, *current_fiber_worker()->scheduler);
+  }
+
+  // Runs jobs until there are none left or a resumed fiber wants our thread
+  void fiber_main(void *argument) {
+    auto *context = static_cast<FiberContext *>(argument);
+    while (true) {
+      auto *job = context->next_job;
+      context->next_job = nullptr;
+
+      while (job != nullptr) {
+        context->function = reinterpret_cast<const void *>(job->function);
         execute(job);
+        job = ready_fiber_count.load(std::memory_order_relaxed) == 0u ? get_job() : nullptr;
       }
 
-      job_ready.wait();
+      switch_to_scheduler(context, FiberState::Idle);
     }
   }
-} // namespace
 
-void WorkStealingQueue::push(Job *job) {
-  auto bottom = bottom_.load(std::memory_order_relaxed);
-  jobs_[bottom & kMask] = job;
+  // Called on the scheduler once the waiting fiber is fully switched out, so
+  // whoever resumes it cannot race with it still running
+  void suspend_on_counter(FiberContext *context) {
+    auto *counter = context->wait_counter;
 
-  bottom_.store(bottom + 1, std::memory_order_release);
+    std::unique_lock<std::mutex> lock{counter->mutex};
+    counter->waiter_count.fetch_add(1u, std::memory_order_seq_cst);
+    if (counter->value.load(std::memory_order_seq_cst) <= context->wait_value) {
+      counter->waiter_count.fetch_sub(1u, std::memory_order_relaxed);
+      lock.unlock();
+      make_ready(context);
+      return;
+    }
 
-  job_ready.notify();
-  notify_all_waiting();
-}
+    context->next_waiter = counter->waiters;
+    counter->waiters = context;
+  }
 
-Job *WorkStealingQueue::pop() {
-  auto bottom = bottom_.fetch_sub(1, std::memory_order_seq_cst) - 1;
-  auto top = top_.load(std::memory_order_relaxed);
-  if (top <= bottom) {
-    auto *job = jobs_[bottom & kMask];
-    if (top != bottom) {
-      return job;
+  void wake_counter_waiters(JobCounter *counter) {
+    std::lock_guard<std::mutex> lock{counter->mutex};
+    auto value = counter->value.load(std::memory_order_seq_cst);
+
+    auto **link = &counter->waiters;
+    while (*link != nullptr) {
+      auto *context = *link;
+      if (value <= context->wait_value) {
+        *link = context->next_waiter;
+        counter->waiter_count.fetch_sub(1u, std::memory_order_relaxed);
+        make_ready(context);
+      } else {
+        link = &context->next_waiter;
+      }
     }
+  }
 
-    if (!top_.compare_exchange_strong(top, top + 1)) {
-      job = nullptr;
+  void suspend_on(FiberContext *context) {
+    if (context->wait_counter != nullptr) {
+      suspend_on_counter(context);
+      return;
     }
 
-    bottom_.store(top + 1, std::memory_order_relaxed);
-    return job;
-  } else {
-    bottom_.store(top, std::memory_order_relaxed);
-    return nullptr;
+    auto handle = context->wait_handle;
+    auto *job = const_cast<Job *>(handle.job);
+
+    auto *edge = allocate_edge();
+    edge->job = nullptr;
+    edge->fiber = context;
+    edge->references.store(2u, std::memory_order_relaxed);
+    edge->claimed.store(false, std::memory_order_relaxed);
+
+    auto *head = job->continuations.load(std::memory_order_acquire);
+    do {
+      if (head == kSealed) {
+        release_edge(edge);
+        make_ready(context);
+        return;
+      }
+      edge->next = head;
+    } while (!job->continuations.compare_exchange_weak(head, edge, std::memory_order_acq_rel, std::memory_order_acquire));
+
+    // The job finished and its slot got reused before we got here, the edge
+    // now hangs off a newer job and we have to resume the fiber ourselves
+    if (job->generation.load(std::memory_order_acquire) != handle.generation) {
+      resume_waiter(edge);
+    }
+
+    drop_reference(edge);
   }
-}
 
-Job *WorkStealingQueue::steal() {
-  auto top = top_.load(std::memory_order_relaxed);
-  auto bottom = bottom_.load(std::memory_order_acquire);
-  if (top < bottom) {
-    auto *job = jobs_[top & kMask];
-    if (!top_.compare_exchange_strong(top, top + 1)) {
-      return nullptr;
+  // Trace slices are paired per thread, so the running job's slice ends here
+  // and starts over on the thread that resumes the fiber
+  void suspend(FiberContext *context) {
+    JobTrace::record(get_thread_index(), JobTrace::Event::End, context->function);
+    switch_to_scheduler(context, FiberState::Waiting);
+    JobTrace::record(get_thread_index(), JobTrace::Event::Begin, context->function);
+  }
+
+  void fiber_wait(FiberContext *context, JobHandle handle) {
+    context->wait_handle = handle;
+    suspend(context);
+  }
+
+  void fiber_wait(FiberContext *context, JobCounter *counter, int32_t value) {
+    context->wait_counter = counter;
+    context->wait_value = value;
+    suspend(context);
+    context->wait_counter = nullptr;
+  }
+
+  void fiber_worker_thread() {
+    Fiber scheduler;
+    FiberWorker worker{&scheduler, nullptr};
+    set_fiber_worker(&worker);
+
+    while (worker_thread_active.load(std::memory_order_relaxed)) {
+      auto *context = pop_ready_fiber();
+
+      if (context == nullptr) {
+        auto *job = spin_for_job();
+
+        if (job == nullptr) {
+          auto key = job_available.prepare_wait();
+          context = pop_ready_fiber();
+          job = context == nullptr ? get_job() : nullptr;
+          if (context == nullptr && job == nullptr && worker_thread_active.load()) {
+            sleep(job_available, key);
+            continue;
+          }
+          job_available.cancel_wait();
+        }
+
+        if (context == nullptr) {
+          context = acquire_fiber();
+          context->next_job = job;
+        }
+      }
+
+      worker.current = context;
+      context->state = FiberState::Running;
+      Fiber::switch_to(scheduler, context->fiber);
+      worker.current = nullptr;
+
+      if (context->state == FiberState::Waiting) {
+        suspend_on(context);
+      } else {
+        release_fiber(context);
+      }
     }
-    return job;
+
+    set_fiber_worker(nullptr);
   }
+#else
+  void make_ready(FiberContext *) { }
+  void wake_counter_waiters(JobCounter *) { }
+#endif
 
-  return nullptr;
-}
+  void allocate_thread_state(uint32_t index) {
+    if (index < job_queues.size()) {
+      job_queues[index] = new JobQueues{};
+    }
+    job_pools[index] = new Pool<Job>{index};
+    edge_pools[index] = new Pool<JobEdge>{index};
+    counter_pools[index] = new Pool<JobCounter>{index};
+    worker_statistics[index] = new WorkerStatistics{};
+    payload_arenas[index] = new PayloadArenas{};
+  }
+
+  // Groups every other thread by how close its CPU is to ours, threads we
+  // know nothing about end up in the last tier
+  Neighbours find_neighbours(uint32_t index, const std::vector<int32_t> &thread_cpus, bool topology_aware) {
+    Neighbours result;
+
+    auto cpu = thread_cpus[index];
+    auto known = topology_aware && cpu != kUnpinned;
+    auto cache = known ? cpu_topology::cache_group(cpu) : cpu_topology::kUnknown;
+    auto node = known ? cpu_topology::numa_node(cpu) : cpu_topology::kUnknown;
+
+    auto distance = [&](uint32_t other) {
+      auto other_cpu = thread_cpus[other];
+      if (!known || other_cpu == kUnpinned) {
+        return 2;
+      }
+      if (cache != cpu_topology::kUnknown && cpu_topology::cache_group(other_cpu) == cache) {
+        return 0;
+      }
+      if (node != cpu_topology::kUnknown && cpu_topology::numa_node(other_cpu) == node) {
+        return 1;
+      }
+      return 2;
+    };
+
+    for (auto tier = 0; tier < 3; ++tier) {
+      for (auto other = 0u; other < thread_cpus.size(); ++other) {
+        if (other != index && distance(other) == tier) {
+          result.victims.push_back(other);
+        }
+      }
+
+      if (result.tier_ends.empty() ? !result.victims.empty() : result.tier_ends.back() != result.victims.size()) {
+        result.tier_ends.push_back(static_cast<uint32_t>(result.victims.size()));
+      }
+    }
+
+    return result;
+  }
+
+  // Everything the worker owns is allocated here, after pinning, so it
+  // lands on the worker's own NUMA node on first touch
+  void worker_thread(uint32_t index, int32_t cpu) {
+    set_thread_index(index);
+
+    if (cpu != kUnpinned) {
+      cpu_topology::pin_current_thread(cpu);
+    }
+
+    allocate_thread_state(index);
+    workers_ready.fetch_add(1u, std::memory_order_release);
 
-void initialize() {
-  int worker_thread_count = std::thread::hardware_concurrency();
+    // Nobody may go looking for work before every queue exists
+    while (!workers_started.load(std::memory_order_acquire)) {
+      std::this_thread::yield();
+    }
+
+#if KNIGHT_HAS_FIBERS
+    if (use_fibers) {
+      fiber_worker_thread();
+      return;
+    }
+#endif
+
+    while (worker_thread_active.load(std::memory_order_relaxed)) {
+      auto *job = spin_for_job();
 
-  get_thread_index();
+      if (job == nullptr) {
+        // Check once more after announcing ourselves so a push that raced
+        // with the spin above cannot be missed
+        auto key = job_available.prepare_wait();
+        job = get_job();
+        if (job == nullptr && worker_thread_active.load()) {
+          sleep(job_available, key);
+          continue;
+        }
+        job_available.cancel_wait();
+      }
+
+      if (job != nullptr) {
+        execute(job);
+      }
+    }
+  }
+} // namespace
 
-  job_queues.emplace_back(new WorkStealingQueue());
+void initialize(const Config &config) {
+  auto cpus = cpu_topology::available_cpus();
+  cpus.erase(std::remove_if(cpus.begin(), cpus.end(), [&config](uint32_t cpu) {
+    return std::find(config.reserved_cpus.begin(), config.reserved_cpus.end(), cpu) != config.reserved_cpus.end();
+  }), cpus.end());
 
-  for (int i = 0; i < worker_thread_count + 1; i++) {
-    job_queues.emplace_back(new WorkStealingQueue{});
-    wait_events.emplace_back(new Semaphore{0, 1});
+  if (!config.worker_cpus.empty()) {
+    cpus = config.worker_cpus;
   }
 
-  Semaphore workers_ready{1 - worker_thread_count};
+  // One worker per CPU it may run on, the explicit list included
+  auto worker_thread_count = config.worker_count;
+  if (worker_thread_count == 0u) {
+    worker_thread_count = std::max<uint32_t>(static_cast<uint32_t>(cpus.size()), 1u);
+  }
 
+  if (config.worker_cpus.empty() && !config.pin_workers) {
+    cpus.clear();
+  }
+
+  use_fibers = KNIGHT_HAS_FIBERS && config.wait_mode == WaitMode::Fiber;
+
+  system_generation.fetch_add(1u, std::memory_order_relaxed);
+  set_thread_index(0u);
+
+  // The main thread and the workers own queues, outside threads come after
+  auto queue_count = worker_thread_count + 1u;
+  auto thread_count = queue_count + config.external_thread_count;
+  std::vector<int32_t> thread_cpus(queue_count, kUnpinned);
+  for (auto i = 0u; i < worker_thread_count && !cpus.empty(); ++i) {
+    thread_cpus[i + 1u] = static_cast<int32_t>(cpus[i % cpus.size()]);
+  }
+
+  job_queues.resize(queue_count, nullptr);
+  job_pools.resize(thread_count, nullptr);
+  edge_pools.resize(thread_count, nullptr);
+  counter_pools.resize(thread_count, nullptr);
+  worker_statistics.resize(thread_count, nullptr);
+  payload_arenas.resize(thread_count, nullptr);
+
+  allocate_thread_state(0u);
+
+  {
+    std::lock_guard<std::mutex> lock{external_slot_mutex};
+    for (auto i = thread_count; i-- > queue_count;) {
+      allocate_thread_state(i);
+      free_external_slots.push_back(i);
+    }
+  }
+
+  for (auto i = 0u; i < queue_count; ++i) {
+    neighbours.push_back(find_neighbours(i, thread_cpus, config.topology_aware_stealing));
+  }
+
+  JobTrace::initialize(thread_count, config.external_thread_count);
+
+  workers_ready = 0u;
+  workers_started = false;
   worker_thread_active = true;
-  for (int i = 0; i < worker_thread_count; i++) {
-    work_threads.emplace_back(worker_thread, std::ref(workers_ready), std::ref(worker_thread_active));
+  for (auto i = 0u; i < worker_thread_count; i++) {
+    work_threads.emplace_back(worker_thread, i + 1u, thread_cpus[i + 1u]);
+  }
+
+  while (workers_ready.load(std::memory_order_acquire) != worker_thread_count) {
+    std::this_thread::yield();
   }
 
-  workers_ready.wait();
+  workers_started.store(true, std::memory_order_release);
 }
 
 void shutdown() {
   worker_thread_active = false;
-
-  for (auto i = 0u; i < work_threads.size(); ++i) {
-    job_ready.notify();
-  }
+  job_available.notify_all();
 
   for (auto &&thread : work_threads) {
     thread.join();
@@ -199,17 +1254,66 @@ void shutdown() {
 
   work_threads.clear();
 
+  {
+    std::lock_guard<std::mutex> lock{main_thread_mutex};
+    main_thread_jobs.clear();
+    main_thread_job_count.store(0u, std::memory_order_relaxed);
+  }
+
+  JobTrace::shutdown();
+
   for (auto &&queue : job_queues) {
     delete queue;
   }
 
-  for (auto &&wait_event : wait_events) {
-    delete wait_event;
+  for (auto &&pool : job_pools) {
+    delete pool;
+  }
+
+  for (auto &&pool : edge_pools) {
+    delete pool;
+  }
+
+  for (auto &&pool : counter_pools) {
+    delete pool;
+  }
+
+  for (auto &&statistics : worker_statistics) {
+    delete statistics;
+  }
+
+  for (auto &&arenas : payload_arenas) {
+    delete arenas;
   }
+
+#if KNIGHT_HAS_FIBERS
+  for (auto &&context : all_fibers) {
+    delete context;
+  }
+
+  all_fibers.clear();
+  free_fibers.clear();
+  ready_fibers.clear();
+  ready_fiber_count = 0u;
+#endif
+
+  job_queues.clear();
+  job_pools.clear();
+  edge_pools.clear();
+  counter_pools.clear();
+  worker_statistics.clear();
+  payload_arenas.clear();
+  neighbours.clear();
+
+  std::lock_guard<std::mutex> lock{external_slot_mutex};
+  free_external_slots.clear();
 }
 
-bool has_job_completed(const Job *job) {
-  return job->unfinished_jobs == 0;
+bool has_job_completed(JobHandle handle) {
+  // A slot only changes generation after its job finished, so a mismatch
+  // means the handle is stale and the job it referred to is long done
+  return is_complete(handle.job) ||
+    handle.job->generation.load(std::memory_order_acquire) != handle.generation;
 }
 
 Job *create_job(JobFunction function) {
@@ -217,6 +1321,11 @@ Job *create_job(JobFunction function) {
   job->function = function;
   job->parent = nullptr;
   job->unfinished_jobs = 1;
+  job->dependencies = 1;
+  job->continuations.store(nullptr, std::memory_order_relaxed);
+  job->priority = JobPriority::Normal;
+  job->spilled = false;
+  job->main_thread = false;
   return job;
 }
 
@@ -225,23 +1334,232 @@ Job *create_job_as_child(Job *parent, JobFunction function) {
 
   auto job = create_job(function);
   job->parent = parent;
+  job->priority = parent->priority;
 
   return job;
 }
 
-void run(Job *job) {
-  auto *queue = get_worker_thread_queue();
-  queue->push(job);
+JobHandle handle_of(const Job *job) {
+  return JobHandle{job, job->generation.load(std::memory_order_relaxed), job->priority};
+}
+
+JobHandle run(Job *job) {
+  auto handle = handle_of(job);
+
+  // Drops the reference create_job() took, jobs with unfinished dependencies
+  // get queued by whichever of them finishes last
+  satisfy_dependency(job);
+
+  return handle;
+}
+
+JobCounter *create_counter() {
+  return allocate_from(counter_pools);
+}
+
+void free_counter(JobCounter *counter) {
+  XASSERT(counter->value.load() == 0, "Freeing a counter with %d jobs still running", counter->value.load());
+  counter_pools[counter->pool]->release(counter, get_thread_index());
+}
+
+int32_t counter_value(const JobCounter *counter) {
+  return counter->value.load(std::memory_order_acquire);
+}
+
+JobHandle run(Job *job, JobCounter *counter) {
+  counter->value.fetch_add(1, std::memory_order_relaxed);
+
+  // Nobody else can see the job yet, so there is no need to race for the list
+  auto *edge = allocate_edge();
+  edge->job = nullptr;
+  edge->counter = counter;
+  edge->next = job->continuations.load(std::memory_order_relaxed);
+  job->continuations.store(edge, std::memory_order_relaxed);
+
+  return run(job);
+}
+
+void add_continuation(Job *job, Job *continuation) {
+  ++continuation->dependencies;
+
+  auto *edge = allocate_edge();
+  edge->job = continuation;
+
+  auto *head = job->continuations.load(std::memory_order_acquire);
+  do {
+    if (head == kSealed) {
+      release_edge(edge);
+      satisfy_dependency(continuation);
+      return;
+    }
+    edge->next = head;
+  } while (!job->continuations.compare_exchange_weak(head, edge, std::memory_order_release, std::memory_order_acquire));
+}
+
+void add_dependency(Job *job, Job *prerequisite) {
+  add_continuation(prerequisite, job);
+}
+
+void set_priority(Job *job, JobPriority priority) {
+  job->priority = priority;
 }
 
-void wait(const Job *job) {
-  while (!has_job_completed(job)) {
+void set_affinity(Job *job, JobAffinity affinity) {
+  job->main_thread = affinity == JobAffinity::MainThread;
+}
+
+void *detail::allocate_payload(Job *job, std::size_t size, std::size_t align) {
+  auto &arena = current_arena();
+  auto spilled = SpilledPayload{arena.allocate(size, align), &arena};
+  memcpy(job->data, &spilled, sizeof(spilled));
+  job->spilled = true;
+  return spilled.data;
+}
+
+bool detail::should_split() {
+  auto *queues = get_worker_thread_queues();
+  if (queues == nullptr) {
+    return true;
+  }
+
+  return std::all_of(std::begin(queues->lanes), std::end(queues->lanes), [](const WorkStealingQueue<Job *> &queue) {
+    return queue.size() == 0;
+  });
+}
+
+void set_steal_policy(const StealPolicy &policy) {
+  XASSERT(policy.victim_count > 0u, "Steal policy must probe at least one victim");
+  XASSERT(policy.batch_size > 0u, "Steal policy must steal at least one job");
+  steal_victim_count.store(policy.victim_count, std::memory_order_relaxed);
+  steal_batch_size.store(policy.batch_size, std::memory_order_relaxed);
+}
+
+void set_background_budget(std::chrono::microseconds budget) {
+  auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(budget).count();
+  background_budget.store(std::max<int64_t>(nanoseconds, 0), std::memory_order_relaxed);
+  job_available.notify_all();
+}
+
+void clear_background_budget() {
+  background_budget.store(kUnlimitedBudget, std::memory_order_relaxed);
+  job_available.notify_all();
+}
+
+void begin_frame() {
+  background_time_spent.store(0, std::memory_order_relaxed);
+  frame_index.fetch_add(1u, std::memory_order_relaxed);
+
+  // Background jobs left over from the last frame may be runnable again
+  job_available.notify_all();
+}
+
+void run_main_thread_jobs() {
+  XASSERT(get_thread_index() == 0u, "Only the main thread runs jobs bound to it");
+
+  while (auto *job = pop_main_thread_job(kJobPriorityCount)) {
+    execute(job);
+  }
+}
+
+uint32_t thread_count() {
+  return static_cast<uint32_t>(worker_statistics.size());
+}
+
+StealStatistics steal_statistics(uint32_t thread_index) {
+  XASSERT(thread_index < worker_statistics.size(), "Invalid thread index %u", thread_index);
+  auto &statistics = *worker_statistics[thread_index];
+  return StealStatistics{
+    statistics.steal_attempts.load(std::memory_order_relaxed),
+    statistics.steal_successes.load(std::memory_order_relaxed),
+    statistics.steal_failures.load(std::memory_order_relaxed)};
+}
+
+void reset_steal_statistics() {
+  for (auto &&statistics : worker_statistics) {
+    statistics->steal_attempts.store(0u, std::memory_order_relaxed);
+    statistics->steal_successes.store(0u, std::memory_order_relaxed);
+    statistics->steal_failures.store(0u, std::memory_order_relaxed);
+  }
+}
+
+void wait(JobHandle handle) {
+#if KNIGHT_HAS_FIBERS
+  auto *worker = current_fiber_worker();
+  if (worker != nullptr && worker->current != nullptr) {
+    if (!has_job_completed(handle)) {
+      fiber_wait(worker->current, handle);
+    }
+
+    XASSERT(has_job_completed(handle), "Fiber resumed before the job it waited on finished");
+    return;
+  }
+#endif
+
+  // Only help with work at least as important as what we are waiting for, a
+  // thread waiting on a background job is fine to ignore the budget
+  auto lowest = handle.priority;
+  auto within_budget = lowest != JobPriority::Background;
+
+  while (!has_job_completed(handle)) {
+    auto *next_job = get_job(lowest, within_budget);
+    if (next_job != nullptr) {
+      execute(next_job);
+      continue;
+    }
+
+    auto key = job_completed.prepare_wait();
+    if (has_job_completed(handle)) {
+      job_completed.cancel_wait();
+      break;
+    }
+
+    next_job = get_job(lowest, within_budget);
+    if (next_job != nullptr) {
+      job_completed.cancel_wait();
+      execute(next_job);
+      continue;
+    }
+
+    sleep(job_completed, key);
+  }
+}
+
+void wait(JobCounter *counter, int32_t value) {
+  auto reached = [counter, value] {
+    return counter->value.load(std::memory_order_acquire) <= value;
+  };
+
+#if KNIGHT_HAS_FIBERS
+  auto *worker = current_fiber_worker();
+  if (worker != nullptr && worker->current != nullptr) {
+    if (!reached()) {
+      fiber_wait(worker->current, counter, value);
+    }
+    return;
+  }
+#endif
+
+  while (!reached()) {
     auto *next_job = get_job();
     if (next_job != nullptr) {
       execute(next_job);
+      continue;
+    }
+
+    auto key = job_completed.prepare_wait();
+    if (reached()) {
+      job_completed.cancel_wait();
+      break;
+    }
+
+    next_job = get_job();
+    if (next_job != nullptr) {
+      job_completed.cancel_wait();
+      execute(next_job);
+      continue;
     }
 
-    wait_events[get_thread_index()]->wait();
+    sleep(job_completed, key);
   }
 }
 
@@ -0,0 +1,213 @@
+#include "job_trace.h"
+#include "common.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace knight {
+namespace JobTrace {
+
+namespace detail {
+
+std::atomic<bool> enabled{false};
+
+} // namespace detail
+
+namespace {
+  struct TraceEvent {
+    uint64_t timestamp;
+    const void *address;
+    Event event;
+  };
+
+  // Only ever written by its own thread
+  struct Ring {
+    explicit Ring(uint32_t capacity) : events(capacity), head{0u} { }
+
+    std::vector<TraceEvent> events;
+    std::atomic<uint64_t> head;
+    char padding[CACHE_LINE_SIZE];
+  };
+
+  uint32_t capacity = 1u << 16;
+  std::vector<Ring *> rings;
+  uint32_t first_external_thread = 0u;
+
+  // Timestamps are converted to microseconds against the wall clock time
+  // that passed between these and the moment the trace is written
+  uint64_t start_timestamp = 0u;
+  std::chrono::steady_clock::time_point start_time;
+
+  std::mutex label_mutex;
+  std::unordered_map<const void *, const char *> labels;
+  const char *shutdown_path = nullptr;
+
+  void write_string(std::FILE *file, const char *string) {
+    std::fputc('"', file);
+    for (; *string != '\0'; ++string) {
+      if (*string == '"' || *string == '\\') {
+        std::fputc('\\', file);
+      }
+      std::fputc(*string, file);
+    }
+    std::fputc('"', file);
+  }
+
+  void write_name(std::FILE *file, const void *address) {
+    {
+      std::lock_guard<std::mutex> lock{label_mutex};
+      auto label = labels.find(address);
+      if (label != labels.end()) {
+        write_string(file, label->second);
+        return;
+      }
+    }
+
+    std::fprintf(file, "\"%p\"", address);
+  }
+
+  void write_event(std::FILE *file, uint32_t thread_index, const TraceEvent &event, double microseconds) {
+    std::fprintf(file, "{\"pid\":0,\"tid\":%u,\"ts\":%.3f,\"name\":", thread_index, microseconds);
+
+    switch (event.event) {
+      case Event::Begin:
+        write_name(file, event.address);
+        std::fputs(",\"ph\":\"B\"}", file);
+        break;
+      case Event::End:
+        write_name(file, event.address);
+        std::fputs(",\"ph\":\"E\"}", file);
+        break;
+      case Event::Steal:
+        write_name(file, event.address);
+        std::fputs(",\"cat\":\"steal\",\"ph\":\"i\",\"s\":\"t\"}", file);
+        break;
+      case Event::Sleep:
+        std::fputs("\"sleep\",\"ph\":\"B\"}", file);
+        break;
+      case Event::Wake:
+        std::fputs("\"sleep\",\"ph\":\"E\"}", file);
+        break;
+    }
+  }
+} // namespace
+
+void set_capacity(uint32_t events_per_thread) {
+  XASSERT(events_per_thread > 0u, "Trace capacity must be positive");
+
+  // Rounded up so the ring can wrap with a mask
+  capacity = 1u;
+  while (capacity < events_per_thread) {
+    capacity <<= 1u;
+  }
+}
+
+void set_enabled(bool enabled) {
+  detail::enabled.store(enabled, std::memory_order_relaxed);
+}
+
+bool enabled() {
+  return detail::enabled.load(std::memory_order_relaxed);
+}
+
+void set_label(JobFunction function, const char *label) {
+  std::lock_guard<std::mutex> lock{label_mutex};
+  labels[reinterpret_cast<const void *>(function)] = label;
+}
+
+void write_on_shutdown(const char *path) {
+  shutdown_path = path;
+}
+
+bool write(const char *path) {
+  auto *file = std::fopen(path, "w");
+  if (file == nullptr) {
+    return false;
+  }
+
+  auto elapsed = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start_time).count();
+  auto ticks = static_cast<double>(detail::timestamp() - start_timestamp);
+  auto ticks_per_microsecond = elapsed > 0.0 ? ticks / elapsed : 1.0;
+
+  std::fputs("{\"traceEvents\":[\n", file);
+
+  std::vector<TraceEvent> events;
+  for (auto thread_index = 0u; thread_index < rings.size(); ++thread_index) {
+    auto &ring = *rings[thread_index];
+    const uint64_t size = ring.events.size();
+
+    auto *thread_name = thread_index == 0u ? "main" : thread_index < first_external_thread ? "worker" : "external";
+    std::fprintf(file,
+      "%s{\"pid\":0,\"tid\":%u,\"ph\":\"M\",\"name\":\"thread_name\",\"args\":{\"name\":\"%s %u\"}}",
+      thread_index == 0u ? "" : ",\n", thread_index, thread_name, thread_index);
+
+    // The owner keeps recording while we copy, whatever it may have
+    // overwritten in the meantime is dropped
+    auto end = ring.head.load(std::memory_order_acquire);
+    auto begin = end > size ? end - size : 0u;
+
+    events.clear();
+    for (auto i = begin; i < end; ++i) {
+      events.push_back(ring.events[i & (size - 1u)]);
+    }
+
+    auto head = ring.head.load(std::memory_order_acquire);
+    auto valid = head + 1u > size ? head + 1u - size : 0u;
+    auto skip = valid > begin ? std::min<uint64_t>(valid - begin, events.size()) : 0u;
+
+    for (auto i = skip; i < events.size(); ++i) {
+      auto &event = events[i];
+      auto microseconds = static_cast<double>(static_cast<int64_t>(event.timestamp - start_timestamp)) / ticks_per_microsecond;
+      std::fputs(",\n", file);
+      write_event(file, thread_index, event, microseconds);
+    }
+  }
+
+  std::fputs("\n]}\n", file);
+
+  return std::fclose(file) == 0;
+}
+
+void initialize(uint32_t thread_count, uint32_t external_thread_count) {
+  for (auto i = 0u; i < thread_count; ++i) {
+    rings.push_back(new Ring{capacity});
+  }
+  first_external_thread = thread_count - external_thread_count;
+
+  start_timestamp = detail::timestamp();
+  start_time = std::chrono::steady_clock::now();
+}
+
+void shutdown() {
+  if (shutdown_path != nullptr) {
+    write(shutdown_path);
+  }
+
+  for (auto &&ring : rings) {
+    delete ring;
+  }
+
+  rings.clear();
+}
+
+namespace detail {
+
+void record(uint32_t thread_index, Event event, const void *address, uint64_t timestamp) {
+  if (thread_index >= rings.size()) {
+    return;
+  }
+
+  auto &ring = *rings[thread_index];
+  auto head = ring.head.load(std::memory_order_relaxed);
+  ring.events[head & (ring.events.size() - 1u)] = TraceEvent{timestamp, address, event};
+  ring.head.store(head + 1u, std::memory_order_release);
+}
+
+} // namespace detail
+
+} // namespace JobTrace
+} // namespace knight
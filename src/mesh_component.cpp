@@ -1,6 +1,5 @@
 #include "mesh_component.h"
 #include "entity_manager.h"
-#include "random.h"
 #include "material.h"
 #include "pointers.h"
 #include "array_object.h"
@@ -8,7 +7,6 @@
 #include "array.h"
 
 #include <gsl.h>
-#include <hash.h>
 #include <logog.hpp>
 
 using namespace foundation;
@@ -22,7 +20,7 @@ MeshComponent::MeshComponent(foundation::Allocator &allocator) :
 void MeshComponent::add(Entity e, Material &material, ArrayObject &vao) {
   auto index = gsl::narrow_cast<uint32_t>(data_.size());
   data_.push_back({e, &material, &vao});
-  hash::set(map_, e.id, index);
+  map_.set(e.id, index);
 }
 
 void MeshComponent::destroy(uint32_t i) {
@@ -32,8 +30,8 @@ void MeshComponent::destroy(uint32_t i) {
 
   data_[i] = data_[last];
 
-  hash::set(map_, last_entity.id, i);
-  hash::remove(map_, entity.id);
+  map_.set(last_entity.id, i);
+  map_.remove(entity.id);
 
   data_.pop_back();
 }
@@ -45,18 +43,4 @@ void MeshComponent::render() const {
   }
 }
 
-// void MeshComponent::GC(const EntityManager &em) {
-//   const auto kAliveInARowThreshold = 4u;
-//   auto alive_in_row = 0u;
-//   while (data_.size > 0 && alive_in_row < kAliveInARowThreshold) {
-//     auto i = random_in_range(0u, data_.size - 1u);
-//     if (em.Alive(data_.entity[i])) {
-//       ++alive_in_row;
-//       continue;
-//     }
-//     alive_in_row = 0;
-//     Destroy(i);
-//   }
-// }
-
 } // namespace knight
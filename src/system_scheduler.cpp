@@ -0,0 +1,113 @@
+#include "system_scheduler.h"
+
+#include <algorithm>
+
+namespace knight {
+
+namespace {
+
+  bool intersects(const Vector<int> &a, const Vector<int> &b) {
+    return std::find_first_of(a.begin(), a.end(), b.begin(), b.end()) != a.end();
+  }
+
+} // namespace
+
+SystemScheduler::System::System(foundation::Allocator &allocator, const char *name, Function function)
+  : name_{name},
+    function_{std::move(function)},
+    reads_{allocator},
+    writes_{allocator},
+    main_thread_{false},
+    dependencies_{allocator} { }
+
+bool SystemScheduler::System::conflicts_with(const System &other) const {
+  return intersects(writes_, other.writes_) ||
+         intersects(writes_, other.reads_) ||
+         intersects(reads_, other.writes_);
+}
+
+SystemScheduler::SystemScheduler(foundation::Allocator &allocator)
+  : allocator_{allocator},
+    systems_{allocator},
+    jobs_{allocator},
+    dirty_{false} { }
+
+auto SystemScheduler::add(const char *name, Function function) -> System & {
+  systems_.emplace_back(allocator_, name, std::move(function));
+  dirty_ = true;
+  return systems_.back();
+}
+
+void SystemScheduler::run_system(Job *, const void *data) {
+  System *system;
+  memory_block::unpack_data(data, system);
+  system->function_();
+}
+
+// Each system depends on every earlier system it conflicts with, unless that
+// ordering already follows from another dependency
+void SystemScheduler::build() {
+  const auto count = systems_.size();
+
+  // reachable[i * count + j] is set when system i already runs after system j
+  Vector<bool> reachable{allocator_};
+  reachable.resize(count * count, false);
+
+  for (auto i = 0u; i < count; ++i) {
+    auto &system = systems_[i];
+    system.dependencies_.clear();
+
+    for (auto j = i; j-- > 0u;) {
+      if (reachable[i * count + j] || !system.conflicts_with(systems_[j])) {
+        continue;
+      }
+
+      system.dependencies_.push_back(j);
+      reachable[i * count + j] = true;
+      for (auto k = 0u; k < j; ++k) {
+        if (reachable[j * count + k]) {
+          reachable[i * count + k] = true;
+        }
+      }
+    }
+  }
+
+  dirty_ = false;
+}
+
+void SystemScheduler::run() {
+  if (systems_.empty()) {
+    return;
+  }
+
+  if (dirty_) {
+    build();
+  }
+
+  // Every edge is added before any job is run, so none of them can have
+  // finished and been recycled yet
+  for (auto &&system : systems_) {
+    auto *job = JobSystem::create_job(run_system, &system);
+    if (system.main_thread_) {
+      JobSystem::set_affinity(job, JobAffinity::MainThread);
+    }
+    jobs_.push_back(job);
+  }
+
+  for (auto i = 0u; i < systems_.size(); ++i) {
+    for (auto &&dependency : systems_[i].dependencies_) {
+      JobSystem::add_dependency(jobs_[i], jobs_[dependency]);
+    }
+  }
+
+  auto *counter = JobSystem::create_counter();
+  for (auto &&job : jobs_) {
+    JobSystem::run(job, counter);
+  }
+  jobs_.clear();
+
+  JobSystem::wait(counter);
+  JobSystem::free_counter(counter);
+}
+
+} // namespace knight
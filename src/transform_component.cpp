@@ -1,5 +1,4 @@
 #include "transform_component.h"
-#include "random.h"
 #include "entity_manager.h"
 #include "memory_block.h"
 
@@ -39,7 +38,7 @@ void TransformComponent::add(Entity e) {
   data_.next_sibling[index] = null_instance;
   data_.prev_sibling[index] = null_instance;
 
-  hash::set(map_, e.id, index);
+  map_.set(e.id, index);
   ++data_.size;
 }
 
@@ -73,26 +72,12 @@ void TransformComponent::destroy(uint32_t i) {
   auto last_entity = data_.entity[last];
 
   swap(instance, last_instance);
-  hash::set(map_, last_entity.id, i);
-  hash::remove(map_, entity.id);
+  map_.set(last_entity.id, i);
+  map_.remove(entity.id);
 
   --data_.size;
 }
 
-void TransformComponent::collect_garbage(const EntityManager &em) {
-  const auto kAliveInARowThreshold = 4u;
-  auto alive_in_row = 0u;
-  while (data_.size > 0 && alive_in_row < kAliveInARowThreshold) {
-    auto i = random_in_range(0u, data_.size - 1u);
-    if (em.alive(data_.entity[i])) {
-      ++alive_in_row;
-      continue;
-    }
-    alive_in_row = 0;
-    destroy(i);
-  }
-}
-
 bool TransformComponent::is_valid(Instance instance) const {
   return instance.i >= 0 && (uint32_t)instance.i < data_.size;
 }
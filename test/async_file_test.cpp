@@ -0,0 +1,97 @@
+#include "async_file.h"
+
+#include <catch.hpp>
+
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace knight;
+
+namespace {
+
+std::string make_contents(uint32_t index, std::size_t size) {
+  std::string contents(size, '\0');
+  for (auto i = 0u; i < size; ++i) {
+    contents[i] = static_cast<char>('a' + (i + index) % 26u);
+  }
+  return contents;
+}
+
+void read_files(bool use_io_uring) {
+  const auto kFileCount = 16u;
+
+  AsyncFile::Config config;
+  config.use_io_uring = use_io_uring;
+  config.queue_depth = 4u;
+  AsyncFile::initialize(config);
+  if (!use_io_uring) {
+    CHECK_FALSE(AsyncFile::uses_io_uring());
+  }
+
+  std::vector<std::string> paths;
+  for (auto i = 0u; i < kFileCount; ++i) {
+    paths.push_back("async_file_test_" + std::to_string(i) + ".txt");
+    std::ofstream file{paths.back(), std::ios::binary};
+    file << make_contents(i, i * 4099u);
+  }
+
+  std::atomic<uint32_t> matching{0};
+  std::vector<JobHandle> handles;
+  for (auto i = 0u; i < kFileCount; ++i) {
+    handles.push_back(AsyncFile::read_file(paths[i].c_str(), [&matching, i](FileData &file) {
+      auto expected = make_contents(i, i * 4099u);
+      if (file.success && std::string(file.data().data(), file.size) == expected) {
+        ++matching;
+      }
+    }));
+  }
+
+  std::atomic<bool> missing_failed{false};
+  auto main_thread = std::this_thread::get_id();
+  std::atomic<bool> on_main_thread{false};
+  handles.push_back(AsyncFile::read_file("async_file_test_missing.txt", [&](FileData &file) {
+    missing_failed = !file.success && file.size == 0u;
+    on_main_thread = std::this_thread::get_id() == main_thread;
+  }, JobAffinity::MainThread));
+
+  // A directory opens fine but has nothing to read
+  std::atomic<bool> directory_failed{false};
+  handles.push_back(AsyncFile::read_file(".", [&directory_failed](FileData &file) {
+    directory_failed = !file.success && file.size == 0u;
+  }));
+
+  for (auto &&handle : handles) {
+    JobSystem::wait(handle);
+  }
+
+  CHECK(matching == kFileCount);
+  CHECK(missing_failed);
+  CHECK(directory_failed);
+  CHECK(on_main_thread);
+
+  AsyncFile::shutdown();
+
+  for (auto &&path : paths) {
+    std::remove(path.c_str());
+  }
+}
+
+} // namespace
+
+TEST_CASE("Async File") {
+  JobSystem::initialize();
+
+  SECTION("Reads through io_uring where available") {
+    read_files(true);
+  }
+
+  SECTION("Reads on a thread pool") {
+    read_files(false);
+  }
+
+  JobSystem::shutdown();
+}
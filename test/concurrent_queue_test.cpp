@@ -1,92 +1,191 @@
-#include "gtest/gtest.h"
 #include "concurrent_queue.h"
 
+#include <catch.hpp>
+
+#include <atomic>
+#include <chrono>
 #include <functional>
+#include <memory>
 #include <thread>
-#include <mutex>
-#include <condition_variable>
-#include <chrono>
+#include <vector>
 
 using knight::ConcurrentQueue;
-using std::thread;
+using knight::BoundedConcurrentQueue;
 using std::chrono::milliseconds;
 
 typedef std::function<void()> Task;
 
-class ConcurrentQueueTest : public ::testing::Test {
- protected:
-  ConcurrentQueue<Task> queue_;
-};
-
-TEST_F(ConcurrentQueueTest, AddAndSize) {
-  queue_.push([] { printf("Task 1"); });
+namespace {
 
-  EXPECT_EQ(1, queue_.size());
-
-  queue_.push([] { printf("Task 2"); });
-
-  EXPECT_EQ(2, queue_.size());
-}
+template<typename Queue>
+void add_and_size(Queue &queue) {
+  queue.push([] { });
+  CHECK(queue.size() == 1u);
 
-void RemoveThread(ConcurrentQueue<Task> &q) {
-  Task t;
-  q.wait_pop(t);
-  t();
+  queue.push([] { });
+  CHECK(queue.size() == 2u);
+  CHECK_FALSE(queue.empty());
 }
 
-TEST_F(ConcurrentQueueTest, WaitAfterAdd) {
+template<typename Queue>
+void wait_before_add(Queue &queue) {
   int result = 0;
 
-  queue_.push([&] { result = 1; });
-
-  std::thread t(RemoveThread, std::ref(queue_));
-
-  t.join();
-
-  EXPECT_EQ(1, result);
-}
-
-TEST_F(ConcurrentQueueTest, WaitBeforeAdd) {
-  int result = 0;
+  std::thread t([&queue] {
+    Task task;
+    queue.wait_pop(task);
+    task();
 
-  std::thread t(RemoveThread, std::ref(queue_));
+    Task second;
+    queue.wait_pop(second);
+    second();
+  });
 
-  queue_.push([&] { result = 1; });
+  queue.push([&] {
+    std::this_thread::sleep_for(milliseconds(10));
+    result = 1;
+  });
+  queue.push([&] { result = 2; });
 
   t.join();
 
-  EXPECT_EQ(1, result);
+  CHECK(result == 2);
+  CHECK(queue.empty());
 }
 
-void MissedAddThread(ConcurrentQueue<Task> &q) {
-  Task t;
-  q.wait_pop(t);
-  t();
-
-  Task t2;
-  q.wait_pop(t2);
-  t2();
-}
-
-TEST_F(ConcurrentQueueTest, MissedAddSignal) {
-  int result = 0;
-
-  std::thread t(MissedAddThread, std::ref(queue_));
+} // namespace
 
-  queue_.push([&] {
-    milliseconds longDuration(100);
-    std::this_thread::sleep_for(longDuration);
-    result = 1;
-  });
+TEST_CASE("Concurrent Queue") {
+  ConcurrentQueue<Task> queue;
 
-  // Add() triggers condition_variable on thread, fortunately it is waiting on
-  // variable with predicate: queue.size() > 1 so that it doesn't miss new tasks
-  queue_.push([&] {
-    result = 2;
-  });
+  SECTION("Add and size") {
+    add_and_size(queue);
+  }
 
-  t.join();
-
-  EXPECT_EQ(2, result);
+  SECTION("Waiting consumers see every item") {
+    wait_before_add(queue);
+  }
 }
 
+TEST_CASE("Bounded Concurrent Queue") {
+  SECTION("Add and size") {
+    BoundedConcurrentQueue<Task> queue{16};
+    add_and_size(queue);
+  }
+
+  SECTION("Waiting consumers see every item") {
+    BoundedConcurrentQueue<Task> queue{16};
+    wait_before_add(queue);
+  }
+
+  SECTION("Full queues refuse items without taking them") {
+    BoundedConcurrentQueue<std::unique_ptr<int>> queue{3};
+    CHECK(queue.capacity() == 4u);
+
+    for (auto i = 0; i < 4; ++i) {
+      CHECK(queue.try_push(std::make_unique<int>(i)));
+    }
+
+    auto item = std::make_unique<int>(4);
+    CHECK_FALSE(queue.try_push(std::move(item)));
+    REQUIRE(item != nullptr);
+
+    std::unique_ptr<int> popped;
+    CHECK(queue.try_pop(popped));
+    CHECK(*popped == 0);
+    CHECK(queue.try_push(std::move(item)));
+  }
+
+  SECTION("Bulk operations move what fits, in order") {
+    BoundedConcurrentQueue<int> queue{8};
+
+    int items[12] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
+    CHECK(queue.try_push_bulk(items, 12u) == 8u);
+    CHECK(queue.try_push_bulk(items + 8, 4u) == 0u);
+
+    int out[5];
+    CHECK(queue.try_pop_bulk(out, 5u) == 5u);
+    CHECK(out[0] == 0);
+    CHECK(out[4] == 4);
+
+    CHECK(queue.try_push_bulk(items + 8, 4u) == 4u);
+
+    int value;
+    for (auto expected = 5; expected < 12; ++expected) {
+      REQUIRE(queue.try_pop(value));
+      CHECK(value == expected);
+    }
+    CHECK(queue.try_pop_bulk(out, 5u) == 0u);
+  }
+
+  SECTION("Many producers and consumers, single and bulk") {
+    const auto kProducerCount = 3u;
+    const auto kItemsPerProducer = 100000u;
+
+    BoundedConcurrentQueue<uint32_t> queue{256};
+    std::atomic<uint64_t> sum{0};
+    std::atomic<uint32_t> received{0};
+
+    std::vector<std::thread> threads;
+    for (auto p = 0u; p < kProducerCount; ++p) {
+      threads.emplace_back([&queue, p] {
+        uint32_t batch[16];
+        auto next = 1u;
+        while (next <= kItemsPerProducer) {
+          if (p % 2u == 0u) {
+            queue.push(next++);
+            continue;
+          }
+
+          auto count = 0u;
+          for (; count < 16u && next + count <= kItemsPerProducer; ++count) {
+            batch[count] = next + count;
+          }
+
+          auto pushed = queue.try_push_bulk(batch, count);
+          next += static_cast<uint32_t>(pushed);
+          if (pushed == 0u) {
+            std::this_thread::yield();
+          }
+        }
+      });
+    }
+
+    const auto kTotal = kProducerCount * kItemsPerProducer;
+    for (auto c = 0u; c < 2u; ++c) {
+      threads.emplace_back([&, c] {
+        uint32_t batch[16];
+        while (received.load() < kTotal) {
+          if (c == 0u) {
+            uint32_t value;
+            if (queue.try_pop(value)) {
+              sum += value;
+              ++received;
+            } else {
+              std::this_thread::yield();
+            }
+            continue;
+          }
+
+          auto popped = queue.try_pop_bulk(batch, 16u);
+          for (auto i = 0_z; i < popped; ++i) {
+            sum += batch[i];
+          }
+          received += static_cast<uint32_t>(popped);
+          if (popped == 0u) {
+            std::this_thread::yield();
+          }
+        }
+      });
+    }
+
+    for (auto &&thread : threads) {
+      thread.join();
+    }
+
+    auto expected = uint64_t{kItemsPerProducer} * (kItemsPerProducer + 1u) / 2u * kProducerCount;
+    CHECK(received == kTotal);
+    CHECK(sum == expected);
+    CHECK(queue.empty());
+  }
+}
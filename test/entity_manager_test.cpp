@@ -1,70 +1,83 @@
-// #include "entity_manager.h"
-// #include "slot_map.h"
-// #include "entity.h"
-// #include "component.h"
-// #include "common.h"
-
-// #include <catch.hpp>
-// #include <memory.h>
-
-// using namespace knight;
-// using namespace foundation;
-
-// struct TestComponent1 : public Component<TestComponent1> {
-//  public:
-//   TestComponent1() : x_(0) { }
-//   TestComponent1(int x) : x_(x) { }
-
-//   int x_;
-// };
-
-// struct TestComponent2 : public Component<TestComponent2> {
-//   TestComponent2() { }
-// };
-
-// TEST_CASE("Entity Manager Test") {
-//   Allocator &a = memory_globals::default_allocator();
-//   {
-//     EntityManager entity_manager_(a);
-//     Entity::ID id_ = entity_manager_.Create();
-
-//     SECTION("Add component in place") {
-//       int x = 3;
-//       auto component = entity_manager_.AddComponent<TestComponent1>(id_, x);
-//       REQUIRE(component != nullptr);
-
-//       CHECK(component->x_ == x);
-
-//       CHECK(entity_manager_.HasComponent<TestComponent1>(id_));
-//       CHECK(entity_manager_.component_mask(id_).test(TestComponent1::family()));
-//   }
-
-//   SECTION("Add component by value") {
-//     auto component = std::make_shared<TestComponent1>();
-//     entity_manager_.AddComponent(id_, component);
-
-//     CHECK(entity_manager_.HasComponent<TestComponent1>(id_));
-//     CHECK(entity_manager_.component_mask(id_).test(TestComponent1::family()));
-//   }
-
-//   SECTION("Getting non-existent component returns nullptr") {
-//     auto component2 = entity_manager_.GetComponent<TestComponent2>(id_);
-//     CHECK(component2 == nullptr);
-//   }
-
-//   auto component = entity_manager_.AddComponent<TestComponent1>(id_);
-
-//   SECTION("Get component by type returns correct component") {
-//     auto component2 = entity_manager_.GetComponent<TestComponent1>(id_);
-//     CHECK(component == component2);
-//   }
-
-//   SECTION("Removing component make component inaccessible") {
-//     entity_manager_.RemoveComponent<TestComponent1>(id_);
-
-//     auto component2 = entity_manager_.GetComponent<TestComponent1>(id_);
-//     CHECK(component2 == nullptr);
-//     CHECK(!entity_manager_.HasComponent<TestComponent1>(id_));
-//   }
-// }
-// }
+#include "common.h"
+#include "entity_manager.h"
+
+#include <catch.hpp>
+#include <memory.h>
+
+#include <vector>
+
+using namespace knight;
+using namespace foundation;
+
+TEST_CASE("Entity Manager") {
+  Allocator &a = memory_globals::default_allocator();
+  {
+    EntityManager entity_manager(a);
+
+    auto single = entity_manager.create();
+
+    std::vector<Entity::ID> ids(1000);
+    entity_manager.create(ids);
+
+    SECTION("Batch created entities are alive and unique") {
+      CHECK(entity_manager.size() == 1001u);
+      for (auto i = 0u; i < ids.size(); ++i) {
+        CHECK(entity_manager.alive(ids[i]));
+        CHECK(ids[i] != single);
+        if (i > 0) {
+          CHECK(ids[i] != ids[i - 1]);
+        }
+      }
+    }
+
+    SECTION("Batch destroy invalidates exactly the given ids") {
+      entity_manager.destroy(gsl::as_span(ids.data(), 500));
+
+      CHECK(entity_manager.size() == 501u);
+      CHECK(entity_manager.alive(single));
+      for (auto i = 0u; i < ids.size(); ++i) {
+        CHECK(entity_manager.alive(ids[i]) == (i >= 500));
+      }
+
+      SECTION("and the freed slots wait for clear_destroyed") {
+        REQUIRE(entity_manager.destroyed().size() == 500);
+
+        std::vector<Entity::ID> created(500);
+        entity_manager.create(created);
+
+        for (auto &&id : created) {
+          CHECK(id.version == 0u);
+        }
+      }
+
+      SECTION("and the freed slots are reused with new versions") {
+        entity_manager.clear_destroyed();
+
+        std::vector<Entity::ID> reused(500);
+        entity_manager.create(reused);
+
+        CHECK(entity_manager.size() == 1001u);
+        for (auto &&id : reused) {
+          CHECK(entity_manager.alive(id));
+          CHECK(id.version == 1u);
+        }
+      }
+    }
+
+    SECTION("All live entities can be destroyed through entities()") {
+      entity_manager.destroy(entity_manager.entities());
+
+      CHECK(entity_manager.size() == 0u);
+      CHECK_FALSE(entity_manager.alive(single));
+      CHECK_FALSE(entity_manager.alive(ids.back()));
+    }
+
+    SECTION("for_each visits every live entity") {
+      auto count = 0u;
+      entity_manager.for_each([&count, &entity_manager](Entity::ID id) {
+        count += entity_manager.alive(id) ? 1u : 0u;
+      });
+      CHECK(count == 1001u);
+    }
+  }
+}
@@ -0,0 +1,637 @@
+#include "job_system.h"
+#include "job_trace.h"
+#include "cpu_topology.h"
+#include "fiber.h"
+
+#include <catch.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <numeric>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace knight;
+
+namespace {
+
+void empty_job(Job *, const void *) { }
+
+void increment_job(Job *, const void *data) {
+  std::atomic<uint32_t> *counter;
+  memory_block::unpack_data(data, counter);
+  ++(*counter);
+}
+
+// Records the order jobs ran in
+void sequence_job(Job *, const void *data) {
+  std::atomic<uint32_t> *next;
+  uint32_t *slot;
+  memory_block::unpack_data(data, next, slot);
+  *slot = (*next)++;
+}
+
+// Too big to fit into Job::data
+struct LargePayload {
+  uint32_t values[32];
+};
+
+void sum_job(Job *, const void *data) {
+  LargePayload payload;
+  std::atomic<uint32_t> *sum;
+  memory_block::unpack_data(data, payload, sum);
+  *sum += std::accumulate(std::begin(payload.values), std::end(payload.values), 0u);
+}
+
+} // namespace
+
+TEST_CASE("Job System") {
+  JobSystem::initialize();
+
+  SECTION("Parent waits for every child") {
+    const auto kJobCount = 1000u;
+    std::atomic<uint32_t> counter{0};
+
+    auto *root = JobSystem::create_job(empty_job);
+    for (auto i = 0u; i < kJobCount; ++i) {
+      auto *child = JobSystem::create_job_as_child(root, increment_job, &counter);
+      JobSystem::run(child);
+    }
+    JobSystem::wait(JobSystem::run(root));
+
+    CHECK(counter == kJobCount);
+  }
+
+  SECTION("More jobs than fit in a single pool block can be in flight") {
+    const auto kJobCount = 20000u;
+    std::atomic<uint32_t> counter{0};
+
+    // Create every child before running any, so all of them are alive at once
+    std::vector<Job *> children;
+    auto *root = JobSystem::create_job(empty_job);
+    for (auto i = 0u; i < kJobCount; ++i) {
+      children.push_back(JobSystem::create_job_as_child(root, increment_job, &counter));
+    }
+
+    for (auto *child : children) {
+      JobSystem::run(child);
+    }
+    JobSystem::wait(JobSystem::run(root));
+
+    CHECK(counter == kJobCount);
+  }
+
+  SECTION("Stale handles report completion") {
+    auto handle = JobSystem::run(JobSystem::create_job(empty_job));
+    JobSystem::wait(handle);
+
+    // Recycle the slot a few times over
+    for (auto i = 0u; i < 10000u; ++i) {
+      JobSystem::wait(JobSystem::run(JobSystem::create_job(empty_job)));
+    }
+
+    CHECK(JobSystem::has_job_completed(handle));
+  }
+
+  SECTION("Steal statistics are consistent") {
+    JobSystem::set_steal_policy(JobSystem::StealPolicy{4u, 8u});
+    JobSystem::reset_steal_statistics();
+
+    const auto kJobCount = 2000u;
+    std::atomic<uint32_t> counter{0};
+
+    auto *root = JobSystem::create_job(empty_job);
+    for (auto i = 0u; i < kJobCount; ++i) {
+      JobSystem::run(JobSystem::create_job_as_child(root, increment_job, &counter));
+    }
+
+    // The children sit in this thread's queue, spinning instead of helping
+    // leaves the workers no way to run them but stealing
+    while (counter != kJobCount) {
+      std::this_thread::yield();
+    }
+    JobSystem::wait(JobSystem::run(root));
+
+    uint64_t successes = 0u;
+    for (auto i = 0u; i < JobSystem::thread_count(); ++i) {
+      auto statistics = JobSystem::steal_statistics(i);
+      CHECK(statistics.attempts == statistics.successes + statistics.failures);
+      successes += statistics.successes;
+    }
+    CHECK(successes > 0u);
+
+    JobSystem::set_steal_policy(JobSystem::StealPolicy{});
+  }
+
+  SECTION("Continuations run after the job they follow") {
+    std::atomic<uint32_t> next{0};
+    uint32_t order[3] = {};
+
+    auto *first = JobSystem::create_job(sequence_job, &next, &order[0]);
+    auto *second = JobSystem::create_job(sequence_job, &next, &order[1]);
+    auto *third = JobSystem::create_job(sequence_job, &next, &order[2]);
+
+    JobSystem::add_continuation(first, second);
+    JobSystem::add_continuation(second, third);
+
+    auto handle = JobSystem::run(third);
+    JobSystem::run(second);
+    JobSystem::run(first);
+    JobSystem::wait(handle);
+
+    CHECK(order[0] == 0u);
+    CHECK(order[1] == 1u);
+    CHECK(order[2] == 2u);
+  }
+
+  SECTION("A job with several prerequisites waits for all of them") {
+    const auto kPrerequisiteCount = 100u;
+    std::atomic<uint32_t> counter{0};
+    std::atomic<uint32_t> next{0};
+    uint32_t seen = 0u;
+
+    auto *last = JobSystem::create_job(sequence_job, &counter, &seen);
+
+    std::vector<Job *> prerequisites;
+    for (auto i = 0u; i < kPrerequisiteCount; ++i) {
+      auto *prerequisite = JobSystem::create_job(increment_job, &counter);
+      JobSystem::add_dependency(last, prerequisite);
+      prerequisites.push_back(prerequisite);
+    }
+
+    auto handle = JobSystem::run(last);
+    for (auto *prerequisite : prerequisites) {
+      JobSystem::run(prerequisite);
+    }
+    JobSystem::wait(handle);
+
+    // sequence_job stores the counter value it saw
+    CHECK(seen == kPrerequisiteCount);
+  }
+
+  SECTION("Background jobs only run while there is budget left") {
+    JobSystem::set_background_budget(std::chrono::microseconds{0});
+
+    std::atomic<uint32_t> counter{0};
+    auto *background_job = JobSystem::create_job(increment_job, &counter);
+    JobSystem::set_priority(background_job, JobPriority::Background);
+    auto handle = JobSystem::run(background_job);
+
+    // Waiting on normal work does not pull background work in
+    JobSystem::wait(JobSystem::run(JobSystem::create_job(empty_job)));
+    std::this_thread::sleep_for(std::chrono::milliseconds{10});
+    CHECK(counter == 0u);
+
+    JobSystem::clear_background_budget();
+    JobSystem::wait(handle);
+    CHECK(counter == 1u);
+  }
+
+  SECTION("Parallel for visits every index once") {
+    const auto kCount = 100000u;
+    std::vector<std::atomic<uint32_t>> visits(kCount);
+    for (auto &&visit : visits) {
+      visit = 0u;
+    }
+
+    JobSystem::parallel_for(0u, kCount, 64u, [&visits](uint32_t i) {
+      ++visits[i];
+    });
+
+    auto all_once = std::all_of(visits.begin(), visits.end(), [](const std::atomic<uint32_t> &visit) {
+      return visit == 1u;
+    });
+    CHECK(all_once);
+  }
+
+  SECTION("Large payloads spill out of the job") {
+    const auto kFrameCount = 8u;
+    const auto kJobCount = 1000u;
+
+    LargePayload payload;
+    std::fill(std::begin(payload.values), std::end(payload.values), 1u);
+
+    for (auto frame = 0u; frame < kFrameCount; ++frame) {
+      JobSystem::begin_frame();
+
+      std::atomic<uint32_t> sum{0};
+      auto *root = JobSystem::create_job(empty_job);
+      for (auto i = 0u; i < kJobCount; ++i) {
+        JobSystem::run(JobSystem::create_job_as_child(root, sum_job, payload, &sum));
+      }
+      JobSystem::wait(JobSystem::run(root));
+
+      CHECK(sum == kJobCount * 32u);
+    }
+  }
+
+  SECTION("Closures are moved in and destroyed after running") {
+    auto owner = std::make_shared<uint32_t>(0u);
+    std::atomic<uint32_t> counter{0};
+
+    std::vector<uint32_t> values(100u, 1u);
+    auto small = JobSystem::create_closure_job([owner, &counter](Job *) {
+      ++counter;
+    });
+    auto large = JobSystem::create_closure_job([owner, values = std::move(values), &counter](Job *) {
+      counter += std::accumulate(values.begin(), values.end(), 0u);
+    });
+
+    CHECK(owner.use_count() == 3);
+
+    JobSystem::wait(JobSystem::run(small));
+    JobSystem::wait(JobSystem::run(large));
+
+    CHECK(counter == 101u);
+    CHECK(owner.use_count() == 1);
+  }
+
+  SECTION("Counters fan in without a parent job") {
+    const auto kFrameCount = 10u;
+    const auto kJobCount = 1000u;
+
+    auto *counter = JobSystem::create_counter();
+    std::atomic<uint32_t> sum{0};
+
+    for (auto frame = 0u; frame < kFrameCount; ++frame) {
+      for (auto i = 0u; i < kJobCount; ++i) {
+        JobSystem::run(JobSystem::create_job(increment_job, &sum), counter);
+      }
+      JobSystem::wait(counter);
+
+      CHECK(JobSystem::counter_value(counter) == 0);
+      CHECK(sum == (frame + 1u) * kJobCount);
+    }
+
+    JobSystem::free_counter(counter);
+  }
+
+  SECTION("Waiting for a counter to come down part of the way") {
+    const auto kJobCount = 100u;
+
+    auto *counter = JobSystem::create_counter();
+    std::atomic<uint32_t> sum{0};
+
+    for (auto i = 0u; i < kJobCount; ++i) {
+      JobSystem::run(JobSystem::create_job(increment_job, &sum), counter);
+    }
+    JobSystem::wait(counter, 50);
+    CHECK(JobSystem::counter_value(counter) <= 50);
+
+    JobSystem::wait(counter);
+    CHECK(sum == kJobCount);
+
+    JobSystem::free_counter(counter);
+  }
+
+  SECTION("Parallel for over a span respects the grain") {
+    std::vector<uint32_t> values(10000u, 1u);
+    std::atomic<uint32_t> sum{0};
+    std::atomic<bool> large_chunk{false};
+
+    JobSystem::parallel_for(gsl::as_span(values), 100u, [&](gsl::span<uint32_t> chunk) {
+      if (chunk.size() > 100) {
+        large_chunk = true;
+      }
+      sum += std::accumulate(chunk.begin(), chunk.end(), 0u);
+    });
+
+    CHECK(sum == 10000u);
+    CHECK_FALSE(large_chunk);
+  }
+
+  SECTION("Jobs bound to the main thread only run there") {
+    const auto kJobCount = 200u;
+
+    auto main_thread = std::this_thread::get_id();
+    std::atomic<uint32_t> on_main_thread{0};
+    std::atomic<uint32_t> elsewhere{0};
+
+    auto *root = JobSystem::create_job(empty_job);
+    for (auto i = 0u; i < kJobCount; ++i) {
+      JobSystem::run(JobSystem::create_closure_job_as_child(root, [&, root](Job *) {
+        auto *upload = JobSystem::create_closure_job_as_child(root, [&](Job *) {
+          if (std::this_thread::get_id() == main_thread) {
+            ++on_main_thread;
+          } else {
+            ++elsewhere;
+          }
+        });
+        JobSystem::set_affinity(upload, JobAffinity::MainThread);
+        JobSystem::run(upload);
+      }));
+    }
+    JobSystem::wait(JobSystem::run(root));
+
+    auto *late = JobSystem::create_closure_job([&](Job *) { ++on_main_thread; });
+    JobSystem::set_affinity(late, JobAffinity::MainThread);
+    auto handle = JobSystem::run(late);
+    JobSystem::run_main_thread_jobs();
+
+    CHECK(JobSystem::has_job_completed(handle));
+    CHECK(on_main_thread == kJobCount + 1u);
+    CHECK(elsewhere == 0u);
+  }
+
+  SECTION("Threads outside the job system submit and wait for jobs") {
+    const auto kThreadCount = 4u;
+    const auto kJobCount = 2000u;
+
+    std::atomic<uint32_t> sum{0};
+    std::atomic<bool> all_finished{true};
+    std::vector<std::thread> threads;
+
+    for (auto t = 0u; t < kThreadCount; ++t) {
+      threads.emplace_back([&] {
+        auto *counter = JobSystem::create_counter();
+        auto *root = JobSystem::create_job(empty_job);
+        for (auto i = 0u; i < kJobCount; ++i) {
+          if (i % 2u == 0u) {
+            JobSystem::run(JobSystem::create_job(increment_job, &sum), counter);
+          } else {
+            JobSystem::run(JobSystem::create_job_as_child(root, increment_job, &sum));
+          }
+        }
+
+        auto handle = JobSystem::run(root);
+        JobSystem::wait(handle);
+        JobSystem::wait(counter);
+        if (!JobSystem::has_job_completed(handle) || JobSystem::counter_value(counter) != 0) {
+          all_finished = false;
+        }
+        JobSystem::free_counter(counter);
+      });
+    }
+
+    for (auto &thread : threads) {
+      thread.join();
+    }
+
+    CHECK(all_finished);
+    CHECK(sum == kThreadCount * kJobCount);
+  }
+
+  JobSystem::shutdown();
+}
+
+#if KNIGHT_HAS_FIBERS
+namespace {
+
+// Each level waits on the next one from inside a job
+void nested_wait_job(Job *, const void *data) {
+  uint32_t depth;
+  std::atomic<uint32_t> *counter;
+  memory_block::unpack_data(data, depth, counter);
+
+  ++(*counter);
+  if (depth > 0u) {
+    JobSystem::wait(JobSystem::run(JobSystem::create_job(nested_wait_job, depth - 1u, counter)));
+  }
+}
+
+// Fans out into children and waits for them on a counter of its own
+void fan_out_job(Job *, const void *data) {
+  const auto kChildCount = 16u;
+
+  std::atomic<uint32_t> *counter;
+  memory_block::unpack_data(data, counter);
+
+  auto *children = JobSystem::create_counter();
+  for (auto i = 0u; i < kChildCount; ++i) {
+    JobSystem::run(JobSystem::create_job(increment_job, counter), children);
+  }
+  JobSystem::wait(children);
+  JobSystem::free_counter(children);
+}
+
+} // namespace
+
+TEST_CASE("Job System with fibers") {
+  JobSystem::Config config;
+  config.wait_mode = JobSystem::WaitMode::Fiber;
+  JobSystem::initialize(config);
+
+  SECTION("Deep chain of jobs waiting on each other") {
+    std::atomic<uint32_t> counter{0};
+    JobSystem::wait(JobSystem::run(JobSystem::create_job(nested_wait_job, 200u, &counter)));
+    CHECK(counter == 201u);
+  }
+
+  SECTION("Jobs waiting on counters") {
+    const auto kJobCount = 64u;
+    std::atomic<uint32_t> counter{0};
+
+    auto *jobs = JobSystem::create_counter();
+    for (auto i = 0u; i < kJobCount; ++i) {
+      JobSystem::run(JobSystem::create_job(fan_out_job, &counter), jobs);
+    }
+    JobSystem::wait(jobs);
+    JobSystem::free_counter(jobs);
+
+    CHECK(counter == kJobCount * 16u);
+  }
+
+  SECTION("Many jobs waiting at once") {
+    const auto kChainCount = 64u;
+    std::atomic<uint32_t> counter{0};
+
+    auto *root = JobSystem::create_job(empty_job);
+    for (auto i = 0u; i < kChainCount; ++i) {
+      JobSystem::run(JobSystem::create_job_as_child(root, nested_wait_job, 20u, &counter));
+    }
+    JobSystem::wait(JobSystem::run(root));
+
+    CHECK(counter == kChainCount * 21u);
+  }
+
+  JobSystem::shutdown();
+}
+#endif
+
+TEST_CASE("Job System with pinned workers") {
+  const auto kJobCount = 1000u;
+
+  JobSystem::Config config;
+  config.worker_count = 3u;
+  config.pin_workers = true;
+  config.topology_aware_stealing = true;
+  config.external_thread_count = 2u;
+  JobSystem::initialize(config);
+
+  // The main thread, every worker and the outside threads
+  CHECK(JobSystem::thread_count() == 6u);
+
+  std::atomic<uint32_t> counter{0};
+  auto *root = JobSystem::create_job(empty_job);
+  for (auto i = 0u; i < kJobCount; ++i) {
+    JobSystem::run(JobSystem::create_job_as_child(root, increment_job, &counter));
+  }
+  JobSystem::wait(JobSystem::run(root));
+
+  CHECK(counter == kJobCount);
+
+  JobSystem::shutdown();
+}
+
+TEST_CASE("Job System wakes waiting threads for jobs from outside") {
+  JobSystem::Config config;
+  config.worker_count = 1u;
+  JobSystem::initialize(config);
+
+  // The counter stays up until a thread outside the job system runs gate
+  auto *counter = JobSystem::create_counter();
+  auto *gate = JobSystem::create_job(empty_job);
+  auto *blocked = JobSystem::create_job(empty_job);
+  JobSystem::add_dependency(blocked, gate);
+  JobSystem::run(blocked, counter);
+
+  // Park the only worker in wait() before the main thread waits as well
+  std::atomic<bool> worker_waiting{false};
+  auto worker_job = JobSystem::run(JobSystem::create_closure_job([counter, &worker_waiting](Job *) {
+    worker_waiting = true;
+    JobSystem::wait(counter);
+  }));
+  while (!worker_waiting) {
+    std::this_thread::yield();
+  }
+
+  std::thread outside{[gate] {
+    std::this_thread::sleep_for(std::chrono::milliseconds{50});
+    JobSystem::run(gate);
+  }};
+
+  JobSystem::wait(counter);
+  JobSystem::wait(worker_job);
+  outside.join();
+
+  CHECK(JobSystem::counter_value(counter) == 0);
+  CHECK(JobSystem::has_job_completed(worker_job));
+
+  JobSystem::free_counter(counter);
+  JobSystem::shutdown();
+}
+
+TEST_CASE("Job System with a list of worker CPUs") {
+  // Without a worker count there is one worker per listed CPU
+  auto cpu = cpu_topology::available_cpus().front();
+
+  JobSystem::Config config;
+  config.worker_cpus = {cpu, cpu};
+  config.external_thread_count = 0u;
+  JobSystem::initialize(config);
+
+  CHECK(JobSystem::thread_count() == 3u);
+
+  std::atomic<uint32_t> counter{0};
+  auto *root = JobSystem::create_job(empty_job);
+  for (auto i = 0u; i < 100u; ++i) {
+    JobSystem::run(JobSystem::create_job_as_child(root, increment_job, &counter));
+  }
+  JobSystem::wait(JobSystem::run(root));
+
+  CHECK(counter == 100u);
+
+  JobSystem::shutdown();
+}
+
+TEST_CASE("Job System tracing") {
+  const char *kPath = "job_trace_test.json";
+
+  JobTrace::set_label(increment_job, "increment");
+  JobTrace::set_enabled(true);
+  JobSystem::initialize();
+
+  std::atomic<uint32_t> counter{0};
+  auto *root = JobSystem::create_job(empty_job);
+  for (auto i = 0u; i < 100u; ++i) {
+    JobSystem::run(JobSystem::create_job_as_child(root, increment_job, &counter));
+  }
+  JobSystem::wait(JobSystem::run(root));
+
+  REQUIRE(JobTrace::write(kPath));
+  JobSystem::shutdown();
+  JobTrace::set_enabled(false);
+
+  std::ifstream file{kPath};
+  std::string trace{std::istreambuf_iterator<char>{file}, std::istreambuf_iterator<char>{}};
+  file.close();
+  std::remove(kPath);
+
+  auto count = [&trace](const std::string &needle) {
+    auto n = 0u;
+    for (auto at = trace.find(needle); at != std::string::npos; at = trace.find(needle, at + 1u)) {
+      ++n;
+    }
+    return n;
+  };
+
+  CHECK(trace.find("{\"traceEvents\":[") == 0u);
+  CHECK(count("\"name\":\"increment\",\"ph\":\"B\"") == 100u);
+  CHECK(count("\"name\":\"increment\",\"ph\":\"E\"") == 100u);
+
+  // Outside threads get slots of their own, named apart from the workers
+  CHECK(count("\"args\":{\"name\":\"external ") == JobSystem::Config{}.external_thread_count);
+}
+
+#if KNIGHT_HAS_FIBERS
+TEST_CASE("Job System tracing with fibers") {
+  const char *kPath = "job_trace_fiber_test.json";
+
+  JobTrace::set_label(nested_wait_job, "nested");
+  JobTrace::set_enabled(true);
+
+  // Enough workers for fibers to get resumed on another thread
+  JobSystem::Config config;
+  config.worker_count = 4u;
+  config.wait_mode = JobSystem::WaitMode::Fiber;
+  JobSystem::initialize(config);
+
+  std::atomic<uint32_t> counter{0};
+  auto *root = JobSystem::create_job(empty_job);
+  for (auto i = 0u; i < 16u; ++i) {
+    JobSystem::run(JobSystem::create_job_as_child(root, nested_wait_job, 8u, &counter));
+  }
+  JobSystem::wait(JobSystem::run(root));
+
+  REQUIRE(JobTrace::write(kPath));
+  JobSystem::shutdown();
+  JobTrace::set_enabled(false);
+
+  // Every slice begins and ends on the same thread, even when the fiber
+  // was suspended and resumed somewhere else
+  std::map<uint32_t, int32_t> depths;
+  auto balanced = true;
+  auto slices = 0u;
+
+  std::ifstream file{kPath};
+  std::string line;
+  while (std::getline(file, line)) {
+    if (line.find("\"name\":\"nested\"") == std::string::npos) {
+      continue;
+    }
+
+    auto tid = static_cast<uint32_t>(std::stoul(line.substr(line.find("\"tid\":") + 6u)));
+    if (line.find("\"ph\":\"B\"") != std::string::npos) {
+      ++depths[tid];
+      ++slices;
+    } else {
+      balanced = balanced && --depths[tid] >= 0;
+    }
+  }
+  file.close();
+  std::remove(kPath);
+
+  CHECK(slices >= 16u * 9u);
+  CHECK(balanced);
+  for (auto &&depth : depths) {
+    CHECK(depth.second == 0);
+  }
+}
+#endif
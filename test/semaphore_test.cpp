@@ -0,0 +1,105 @@
+#include "semaphore.h"
+
+#include <catch.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+using knight::Semaphore;
+
+TEST_CASE("Semaphore") {
+  SECTION("Counts signals") {
+    Semaphore semaphore{1};
+    CHECK(semaphore.try_wait());
+    CHECK_FALSE(semaphore.try_wait());
+
+    semaphore.notify(2);
+    semaphore.wait();
+    CHECK(semaphore.try_wait());
+    CHECK_FALSE(semaphore.try_wait());
+  }
+
+  SECTION("Never counts beyond its maximum") {
+    Semaphore semaphore{0, 2};
+    semaphore.notify(5);
+    CHECK(semaphore.try_wait());
+    CHECK(semaphore.try_wait());
+    CHECK_FALSE(semaphore.try_wait());
+  }
+
+  SECTION("Timed waits give up") {
+    Semaphore semaphore;
+    auto start = std::chrono::steady_clock::now();
+    CHECK_FALSE(semaphore.wait_for(std::chrono::milliseconds(20)));
+    auto waited = std::chrono::steady_clock::now() - start;
+    CHECK((waited >= std::chrono::milliseconds(20)));
+
+    // A timed out waiter does not swallow a later signal
+    semaphore.notify();
+    CHECK(semaphore.try_wait());
+  }
+
+  SECTION("notify(n) releases n waiting threads") {
+    const auto kThreadCount = 4;
+    Semaphore semaphore;
+    std::atomic<int> released{0};
+    std::atomic<int> timed_out{0};
+
+    std::vector<std::thread> threads;
+    for (auto i = 0; i < kThreadCount; ++i) {
+      threads.emplace_back([&, i] {
+        if (i % 2 == 0) {
+          semaphore.wait();
+          ++released;
+        } else if (semaphore.wait_for(std::chrono::seconds(10))) {
+          ++released;
+        } else {
+          ++timed_out;
+        }
+      });
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    semaphore.notify(kThreadCount);
+    for (auto &&thread : threads) {
+      thread.join();
+    }
+
+    CHECK(released == kThreadCount);
+    CHECK(timed_out == 0);
+    CHECK_FALSE(semaphore.try_wait());
+  }
+
+  SECTION("Producers and consumers") {
+    const auto kItemCount = 100000;
+    Semaphore semaphore;
+    std::atomic<int> consumed{0};
+
+    std::vector<std::thread> threads;
+    for (auto i = 0; i < 2; ++i) {
+      threads.emplace_back([&] {
+        for (auto j = 0; j < kItemCount; ++j) {
+          semaphore.notify();
+        }
+      });
+      threads.emplace_back([&] {
+        for (auto j = 0; j < kItemCount; ++j) {
+          if (j % 4 == 0) {
+            while (!semaphore.wait_for(std::chrono::microseconds(50))) { }
+          } else {
+            semaphore.wait();
+          }
+          ++consumed;
+        }
+      });
+    }
+    for (auto &&thread : threads) {
+      thread.join();
+    }
+
+    CHECK(consumed == 2 * kItemCount);
+    CHECK_FALSE(semaphore.try_wait());
+  }
+}
@@ -4,6 +4,9 @@
 
 #include <catch.hpp>
 
+#include <set>
+#include <vector>
+
 using namespace knight;
 using namespace foundation;
 
@@ -51,3 +54,81 @@ TEST_CASE("Slot Map") {
     }
   }
 }
+
+TEST_CASE("Slot Map dense iteration") {
+  Allocator &a = memory_globals::default_allocator();
+  {
+    SlotMap<Object, Object::ID> slot_map(a);
+
+    std::vector<Object::ID> ids;
+    for (auto i = 0; i < 600; ++i) {
+      ids.push_back(slot_map.create());
+    }
+
+    // Punch holes across chunks
+    for (auto i = 0u; i < ids.size(); i += 3) {
+      slot_map.destroy(ids[i]);
+    }
+    CHECK(slot_map.size() == 400u);
+
+    SECTION("Ids are packed and all of them are alive") {
+      auto live = slot_map.ids();
+      REQUIRE(live.size() == 400);
+      for (auto &&id : live) {
+        CHECK(slot_map.get(id) != nullptr);
+      }
+    }
+
+    SECTION("for_each visits every live object once") {
+      std::set<Object::ID::type> visited;
+      slot_map.for_each([&visited](Object &object) {
+        visited.insert(object.id);
+      });
+
+      CHECK(visited.size() == 400u);
+      for (auto i = 0u; i < ids.size(); ++i) {
+        CHECK(visited.count(ids[i]) == (i % 3 == 0 ? 0u : 1u));
+      }
+    }
+
+    SECTION("for_each may destroy the object it is given") {
+      slot_map.for_each([&slot_map](Object &object) {
+        if (object.id.index % 2 == 0) {
+          slot_map.destroy(object.id);
+        }
+      });
+
+      CHECK(slot_map.size() == 200u);
+      for (auto &&id : slot_map.ids()) {
+        CHECK((id.index % 2 == 1));
+      }
+    }
+  }
+}
+
+namespace {
+
+int destroyed_objects = 0;
+
+struct CountedObject {
+  typedef ID32<CountedObject>::ID ID;
+
+  ~CountedObject() { ++destroyed_objects; }
+
+  ID id;
+};
+
+} // namespace
+
+TEST_CASE("Slot Map destroys every object in its chunks") {
+  Allocator &a = memory_globals::default_allocator();
+  destroyed_objects = 0;
+  {
+    SlotMap<CountedObject, CountedObject::ID> slot_map(a);
+
+    // One more than a chunk of 256 objects
+    std::vector<CountedObject::ID> ids(257);
+    slot_map.create(ids);
+  }
+  CHECK(destroyed_objects == 2 * 256);
+}
@@ -0,0 +1,65 @@
+#include "sparse_array.h"
+#include "types.h"
+
+#include <catch.hpp>
+#include <memory.h>
+
+using namespace knight;
+using namespace foundation;
+
+TEST_CASE("Sparse Array") {
+  Allocator &a = memory_globals::default_allocator();
+  {
+    SparseArray<uint32_t> array(a);
+
+    Entity::ID id;
+    id.index = 5;
+    id.version = 2;
+
+    SECTION("Missing ids return the default") {
+      CHECK_FALSE(array.has(id));
+      CHECK(array.get(id, 7u) == 7u);
+    }
+
+    array.set(id, 42u);
+
+    SECTION("Stored values are found by their id") {
+      CHECK(array.has(id));
+      CHECK(array.get(id, 0u) == 42u);
+    }
+
+    SECTION("Other versions at the same index are not found") {
+      auto old_id = id;
+      old_id.version = 1;
+      CHECK_FALSE(array.has(old_id));
+      CHECK(array.get(old_id, 0u) == 0u);
+
+      // Storing the new version replaces the old one
+      auto new_id = id;
+      new_id.version = 3;
+      array.set(new_id, 43u);
+      CHECK(array.get(new_id, 0u) == 43u);
+      CHECK_FALSE(array.has(id));
+    }
+
+    SECTION("Removing a value") {
+      array.remove(id);
+      CHECK_FALSE(array.has(id));
+
+      // Removing again does nothing
+      array.remove(id);
+      CHECK_FALSE(array.has(id));
+    }
+
+    SECTION("Indices far apart land on different pages") {
+      Entity::ID far_id;
+      far_id.index = 10 * SparseArray<uint32_t>::kPageSize + 3;
+      far_id.version = 0;
+
+      CHECK_FALSE(array.has(far_id));
+      array.set(far_id, 9u);
+      CHECK(array.get(far_id, 0u) == 9u);
+      CHECK(array.get(id, 0u) == 42u);
+    }
+  }
+}
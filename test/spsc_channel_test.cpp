@@ -0,0 +1,103 @@
+#include "spsc_channel.h"
+
+#include <catch.hpp>
+
+#include <memory>
+#include <string>
+#include <thread>
+
+using knight::SpscChannel;
+
+namespace {
+
+struct Counted {
+  Counted(int value, int &live) : value{value}, live{&live} { ++live; }
+  Counted(Counted &&other) : value{other.value}, live{other.live} { ++*live; }
+  Counted &operator=(Counted &&other) {
+    value = other.value;
+    return *this;
+  }
+  ~Counted() { --*live; }
+
+  int value;
+  int *live;
+};
+
+} // namespace
+
+TEST_CASE("SPSC Channel") {
+  SECTION("Items are constructed in place and come out in order") {
+    int live = 0;
+    {
+      SpscChannel<Counted> channel{3};
+      CHECK(channel.capacity() == 4u);
+
+      for (auto i = 0; i < 4; ++i) {
+        CHECK(channel.try_emplace(i, live));
+      }
+      CHECK_FALSE(channel.try_emplace(4, live));
+      CHECK(live == 4);
+      CHECK(channel.size() == 4u);
+
+      REQUIRE(channel.front() != nullptr);
+      CHECK(channel.front()->value == 0);
+      channel.pop();
+      CHECK(live == 3);
+
+      CHECK(channel.try_emplace(4, live));
+      for (auto expected = 1; expected <= 4; ++expected) {
+        REQUIRE(channel.front() != nullptr);
+        CHECK(channel.front()->value == expected);
+        channel.pop();
+      }
+      CHECK(channel.front() == nullptr);
+      CHECK(channel.empty());
+
+      channel.try_emplace(5, live);
+      channel.try_emplace(6, live);
+    }
+
+    // Whatever was left is destroyed with the channel
+    CHECK(live == 0);
+  }
+
+  SECTION("Move only items") {
+    SpscChannel<std::unique_ptr<std::string>> channel{2};
+    CHECK(channel.try_push(std::make_unique<std::string>("mesh")));
+
+    std::unique_ptr<std::string> item;
+    CHECK(channel.try_pop(item));
+    CHECK(*item == "mesh");
+    CHECK_FALSE(channel.try_pop(item));
+  }
+
+  SECTION("A producer and a consumer thread") {
+    const auto kItemCount = 1000000u;
+    SpscChannel<uint32_t> channel{64};
+
+    std::thread producer([&channel] {
+      for (auto i = 0u; i < kItemCount; ) {
+        if (channel.try_push(i)) {
+          ++i;
+        } else {
+          std::this_thread::yield();
+        }
+      }
+    });
+
+    auto in_order = true;
+    for (auto expected = 0u; expected < kItemCount; ) {
+      uint32_t value;
+      if (channel.try_pop(value)) {
+        in_order = in_order && value == expected;
+        ++expected;
+      } else {
+        std::this_thread::yield();
+      }
+    }
+    producer.join();
+
+    CHECK(in_order);
+    CHECK(channel.empty());
+  }
+}
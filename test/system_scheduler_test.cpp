@@ -0,0 +1,88 @@
+#include "system_scheduler.h"
+
+#include <catch.hpp>
+#include <memory.h>
+
+#include <atomic>
+#include <thread>
+
+using namespace knight;
+
+namespace {
+
+struct Position {};
+struct Velocity {};
+struct Mesh {};
+
+} // namespace
+
+TEST_CASE("System Scheduler") {
+  JobSystem::initialize();
+  auto &allocator = foundation::memory_globals::default_allocator();
+
+  {
+    SystemScheduler scheduler{allocator};
+    std::atomic<uint32_t> next{0};
+
+    SECTION("Conflicting systems run in the order they were added") {
+      uint32_t integrate = 0u, render = 0u, cull = 0u;
+
+      scheduler.add("integrate", [&] { integrate = next++; })
+        .reads<Velocity>()
+        .writes<Position>();
+      scheduler.add("render", [&] { render = next++; })
+        .reads<Position>()
+        .reads<Mesh>();
+      scheduler.add("cull", [&] { cull = next++; })
+        .writes<Mesh>();
+
+      for (auto frame = 0u; frame < 100u; ++frame) {
+        next = 0u;
+        scheduler.run();
+
+        CHECK(next == 3u);
+        CHECK(integrate < render);
+        CHECK(render < cull);
+      }
+    }
+
+    SECTION("Readers of the same type all run") {
+      const auto kSystemCount = 32u;
+      std::atomic<uint32_t> readers{0};
+      std::atomic<bool> early_reader{false};
+      uint32_t writer = 0u;
+
+      scheduler.add("writer", [&] { writer = next++; }).writes<Position>();
+      for (auto i = 0u; i < kSystemCount; ++i) {
+        scheduler.add("reader", [&] {
+          if (next.load() <= writer) {
+            early_reader = true;
+          }
+          ++readers;
+        }).reads<Position>();
+      }
+
+      scheduler.run();
+      CHECK(readers == kSystemCount);
+      CHECK_FALSE(early_reader);
+    }
+
+    SECTION("Main thread systems run on the thread calling run") {
+      std::thread::id upload;
+      uint32_t simulate = 0u, draw = 0u;
+
+      scheduler.add("simulate", [&] { simulate = next++; }).writes<Position>();
+      scheduler.add("upload", [&] { upload = std::this_thread::get_id(); })
+        .reads<Position>()
+        .writes<Mesh>()
+        .on_main_thread();
+      scheduler.add("draw", [&] { draw = next++; }).reads<Mesh>();
+
+      scheduler.run();
+      CHECK(upload == std::this_thread::get_id());
+      CHECK(simulate < draw);
+    }
+  }
+
+  JobSystem::shutdown();
+}
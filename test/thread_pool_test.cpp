@@ -1,41 +1,154 @@
-#include "gtest/gtest.h"
 #include "thread_pool.h"
 
+#include <catch.hpp>
+
+#include <algorithm>
+#include <array>
 #include <atomic>
 #include <chrono>
+#include <memory>
+#include <numeric>
+#include <string>
+#include <vector>
 
 using knight::ThreadPool;
+using knight::TaskFuture;
+using knight::TaskGroup;
+
+TEST_CASE("Thread Pool") {
+  SECTION("Sync waits for every task") {
+    std::atomic_uint result(0);
+    unsigned int numTasks = 10;
+
+    ThreadPool pool(2);
+
+    for (unsigned int i = 0; i < numTasks; ++i) {
+      pool.Enqueue([&] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(7));
+        result++;
+      });
+    }
+
+    pool.Sync();
+
+    CHECK(result == numTasks);
+  }
 
-class ThreadPoolTest : public ::testing::Test {
-  
-};
+  SECTION("Arguments are stored with the task") {
+    std::atomic_uint result(0);
+    ThreadPool pool(2);
 
-// TEST_F(ThreadPoolTest, Add) {
-//   EXPECT_EQ(0, pool_.task_count());
+    for (auto i = 1u; i <= 100u; ++i) {
+      pool.Enqueue([&result](unsigned int value, const std::string &name) {
+        result += value * static_cast<unsigned int>(name.size());
+      }, i, std::string("ab"));
+    }
+    pool.Sync();
 
-//   pool_.Add([&] { });
+    CHECK(result == 2u * 5050u);
+  }
+
+  SECTION("Futures hold the result of their task") {
+    ThreadPool pool(2);
 
-//   EXPECT_EQ(1, pool_.task_count());
+    std::vector<TaskFuture<uint64_t>> futures;
+    for (auto i = 0u; i < 64u; ++i) {
+      futures.push_back(pool.Submit([](uint64_t value) { return value * value; }, uint64_t{i}));
+    }
 
-//   pool_.Add([&] { });
+    auto void_future = pool.Submit([] { });
+
+    // Too large to be stored in place
+    std::array<uint64_t, 32> values;
+    std::iota(values.begin(), values.end(), 0u);
+    auto large_future = pool.Submit([values] {
+      return std::accumulate(values.begin(), values.end(), uint64_t{0});
+    });
+
+    for (auto i = 0u; i < futures.size(); ++i) {
+      CHECK(futures[i].get() == i * i);
+    }
+
+    void_future.wait();
+    CHECK(void_future.ready());
+    CHECK(large_future.get() == 496u);
+  }
 
-//   EXPECT_EQ(2, pool_.task_count());
-// }
+  SECTION("Ranges of tiny tasks overflowing the queue") {
+    const auto kTaskCount = 50000u;
+    std::vector<std::atomic_uint> visits(kTaskCount);
 
-TEST_F(ThreadPoolTest, StartAndWait) {
-  std::atomic_uint result(0);
-  int numTasks = 10;
-  
-  ThreadPool pool(2);
+    ThreadPool pool(2, 256);
+    pool.EnqueueRange(0u, kTaskCount, [&visits](std::size_t i) { visits[i]++; });
+    pool.Sync();
 
-  for (int i = 0; i < numTasks; ++i) {
-    pool.Enqueue([&] {
-      std::this_thread::sleep_for(std::chrono::milliseconds(7));
-      result++; 
+    auto visited_once = std::all_of(visits.begin(), visits.end(), [](const std::atomic_uint &count) {
+      return count == 1u;
     });
+    CHECK(visited_once);
   }
 
-  pool.Sync();
+  SECTION("Task groups wait only for their own tasks") {
+    ThreadPool pool(2);
+    TaskGroup loading(pool);
+    TaskGroup tooling(pool);
 
-  EXPECT_EQ(numTasks, result);
+    // Kept busy on a worker, so the waits below cannot pick it up themselves
+    std::atomic_bool started(false);
+    std::atomic_bool release(false);
+    loading.Enqueue([&] {
+      started = true;
+      while (!release) {
+        std::this_thread::yield();
+      }
+    });
+    while (!started) {
+      std::this_thread::yield();
+    }
+
+    std::atomic_uint result(0);
+    tooling.EnqueueRange(0u, 1000u, [&result](std::size_t) { result++; });
+    tooling.Wait();
+
+    CHECK(result == 1000u);
+    CHECK_FALSE(loading.Done());
+
+    release = true;
+    loading.Wait();
+    CHECK(loading.Done());
+  }
+
+  SECTION("Waiting threads run the tasks themselves") {
+    ThreadPool pool(0);
+    TaskGroup group(pool);
+
+    std::atomic_uint result(0);
+    for (auto i = 0u; i < 100u; ++i) {
+      group.Enqueue([&result](unsigned int value) { result += value; }, i);
+    }
+    group.Wait();
+    CHECK(result == 4950u);
+
+    pool.Enqueue([&result] { result = 0u; });
+    pool.Sync();
+    CHECK(result == 0u);
+
+    auto future = pool.Submit([] { return 42u; });
+    CHECK_FALSE(future.ready());
+    CHECK(future.get() == 42u);
+  }
+
+  SECTION("Tasks dropped with the pool let go of their future") {
+    auto owned = std::make_shared<int>(7);
+    TaskFuture<int> future;
+    {
+      ThreadPool pool(0);
+      future = pool.Submit([owned] { return *owned; });
+      CHECK(owned.use_count() == 2);
+    }
+
+    CHECK(owned.use_count() == 1);
+    future.wait();
+    CHECK_FALSE(future.ready());
+  }
 }
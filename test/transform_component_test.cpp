@@ -72,4 +72,51 @@ TEST_CASE("Transform Component") {
     CHECK(transform_component->local(transform) == new_transform_matrix);
     CHECK(transform_component->world(transform) == glm::mat4(1.0f));
   }
+
+  SECTION("Destroyed entities are collected at the end of the frame") {
+    auto other_entity_id = entity_manager->create();
+    auto other_entity = *entity_manager->get(other_entity_id);
+
+    transform_component->add(other_entity);
+    transform_component->set_local(transform_component->lookup(other_entity), glm::mat4(2.0f));
+    CHECK(transform_component->lookup(other_entity).i == 1);
+
+    entity_manager->destroy(entity_id);
+
+    REQUIRE(entity_manager->destroyed().size() == 1);
+    CHECK(entity_manager->destroyed()[0] == entity_id);
+
+    transform_component->collect_garbage(*entity_manager);
+    entity_manager->clear_destroyed();
+
+    // The survivor was moved into the hole
+    auto other_transform = transform_component->lookup(other_entity);
+    CHECK(other_transform.i == 0);
+    CHECK(transform_component->local(other_transform) == glm::mat4(2.0f));
+    CHECK_FALSE(transform_component->is_valid(transform_component->make_instance(1)));
+    CHECK(entity_manager->destroyed().size() == 0);
+
+    // Nothing left to collect
+    transform_component->collect_garbage(*entity_manager);
+    CHECK(transform_component->lookup(other_entity).i == 0);
+  }
+
+  SECTION("Entities created in the frame of a destroy do not hide it from collection") {
+    entity_manager->destroy(entity_id);
+
+    auto new_entity_id = entity_manager->create();
+    auto new_entity = *entity_manager->get(new_entity_id);
+    CHECK(new_entity_id.index != entity_id.index);
+
+    transform_component->add(new_entity);
+    transform_component->set_local(transform_component->lookup(new_entity), glm::mat4(2.0f));
+
+    transform_component->collect_garbage(*entity_manager);
+    entity_manager->clear_destroyed();
+
+    auto new_transform = transform_component->lookup(new_entity);
+    CHECK(new_transform.i == 0);
+    CHECK(transform_component->local(new_transform) == glm::mat4(2.0f));
+    CHECK_FALSE(transform_component->is_valid(transform_component->make_instance(1)));
+  }
 }
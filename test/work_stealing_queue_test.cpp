@@ -0,0 +1,99 @@
+#include "work_stealing_queue.h"
+
+#include <catch.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+using namespace knight;
+
+namespace {
+
+int *item(uintptr_t i) {
+  return reinterpret_cast<int *>(i + 1u);
+}
+
+uintptr_t index(int *item) {
+  return reinterpret_cast<uintptr_t>(item) - 1u;
+}
+
+} // namespace
+
+TEST_CASE("Work stealing queue") {
+  SECTION("Owner pops newest first, thieves steal oldest first") {
+    WorkStealingQueue<int *> queue{4};
+    queue.push(item(0u));
+    queue.push(item(1u));
+    queue.push(item(2u));
+
+    CHECK(queue.pop() == item(2u));
+    CHECK(queue.steal() == item(0u));
+    CHECK(queue.pop() == item(1u));
+    CHECK(queue.pop() == nullptr);
+    CHECK(queue.steal() == nullptr);
+  }
+
+  SECTION("Grows instead of dropping items") {
+    const auto kItemCount = 10000u;
+    WorkStealingQueue<int *> queue{2};
+
+    for (auto i = 0u; i < kItemCount; ++i) {
+      queue.push(item(i));
+    }
+    CHECK(queue.size() == kItemCount);
+    CHECK(queue.capacity() >= kItemCount);
+
+    auto in_order = true;
+    for (auto i = 0u; i < kItemCount; ++i) {
+      in_order &= queue.steal() == item(i);
+    }
+    CHECK(in_order);
+  }
+
+  SECTION("Every item is taken exactly once") {
+    const auto kItemCount = 200000u;
+    const auto kThiefCount = 3u;
+
+    WorkStealingQueue<int *> queue{16};
+    std::vector<std::atomic<uint32_t>> taken(kItemCount);
+    std::atomic<bool> done{false};
+
+    std::vector<std::thread> thieves;
+    for (auto i = 0u; i < kThiefCount; ++i) {
+      thieves.emplace_back([&] {
+        while (!done.load()) {
+          auto *stolen = queue.steal();
+          if (stolen != nullptr) {
+            ++taken[index(stolen)];
+          }
+        }
+      });
+    }
+
+    for (auto i = 0u; i < kItemCount; ++i) {
+      queue.push(item(i));
+      if (i % 3u == 0u) {
+        auto *popped = queue.pop();
+        if (popped != nullptr) {
+          ++taken[index(popped)];
+        }
+      }
+    }
+
+    while (auto *popped = queue.pop()) {
+      ++taken[index(popped)];
+    }
+    done = true;
+
+    for (auto &&thief : thieves) {
+      thief.join();
+    }
+
+    auto all_once = std::all_of(taken.begin(), taken.end(), [](const std::atomic<uint32_t> &count) {
+      return count == 1u;
+    });
+    CHECK(all_once);
+  }
+}
@@ -94,13 +94,13 @@ namespace foundation
 	}
 
 	template<typename T>
-	void make_array_delete(T *array, uint32_t count) {
+	void Allocator::make_array_delete(T *array, uint32_t count) {
 		if (array != nullptr) {
 			for (auto i = 0u; i < count; ++i) {
-				array[i]->~T();
+				array[i].~T();
 			}
+			deallocate(array);
 		}
-		deallocate(array);
 	}
 
 	class HeapAllocator : public Allocator {